@@ -0,0 +1,545 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libgbz80aid.h"
+
+// Struct for holding the generated inputs every benchmark draws from
+struct Corpus {
+	// Machine code covering every opcode, and the number of instructions
+	struct Buffer code;
+	int instructions;
+
+	// The same code as hex text, as -o asm would take it on the command line
+	char *hex;
+	int hex_size;
+
+	// Assembly source, with and without labels, and their line counts
+	char *source;
+	int source_size;
+	int source_lines;
+	char *labeled;
+	int labeled_size;
+	int labeled_lines;
+
+	// Scratch copy, since the parsers work on their input in place
+	char *scratch;
+};
+
+// Struct for holding one benchmark and its results
+struct Bench {
+	char *name;
+	char *unit;
+	void (*run)(struct Context*, struct Corpus*);
+	void (*prepare)(struct Corpus*);
+	double ns_per_unit;
+	double mb_per_sec;
+	double allocations;
+	long units;
+	long bytes;
+};
+
+// Struct for holding one result of a saved run
+struct Baseline {
+	char name[32];
+	double ns_per_unit;
+};
+
+unsigned int next_random(void);
+void count_sink(void*, const char*, int);
+void make_code(struct Corpus*, int);
+void make_hex(struct Corpus*);
+void make_sources(struct Corpus*);
+double now(void);
+void prepare_source(struct Corpus*);
+void prepare_labeled(struct Corpus*);
+void prepare_hex(struct Corpus*);
+void run_asm_to_hex(struct Context*, struct Corpus*);
+void run_parse_hex(struct Context*, struct Corpus*);
+void run_hex_to_asm(struct Context*, struct Corpus*);
+void run_hex_to_bgb(struct Context*, struct Corpus*);
+void run_hex_to_gen1(struct Context*, struct Corpus*);
+void run_hex_to_gen2(struct Context*, struct Corpus*);
+void run_hex_to_joy(struct Context*, struct Corpus*);
+void run_print_hex(struct Context*, struct Corpus*);
+int load_baseline(char*, struct Baseline*, int);
+void usage(char*);
+
+
+// Allocations made since the start of the run. Counting needs glibc, which
+// lets a program replace malloc and friends with its own versions.
+long allocations = 0;
+
+#ifdef __GLIBC__
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void*, size_t);
+void __libc_free(void*);
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+// State of the xorshift generator. The seed is fixed so every run (and every
+// machine) benchmarks exactly the same corpus.
+unsigned int random_state = 0x8F8F8F8F;
+
+
+int main(int argc, char* argv[])
+{
+	char *save = 0;
+	char *compare = 0;
+	int size = 4;
+	int runs = 5;
+	double threshold = 10;
+	int slower = 0;
+
+	struct Bench benches[] = {
+		{.name = "asm_to_hex",        .unit = "line",  .run = run_asm_to_hex,  .prepare = prepare_source},
+		{.name = "asm_to_hex/labels", .unit = "line",  .run = run_asm_to_hex,  .prepare = prepare_labeled},
+		{.name = "parse_hex",         .unit = "byte",  .run = run_parse_hex,   .prepare = prepare_hex},
+		{.name = "print_hex",         .unit = "byte",  .run = run_print_hex},
+		{.name = "hex_to_asm",        .unit = "instr", .run = run_hex_to_asm},
+		{.name = "hex_to_asm/bgb",    .unit = "instr", .run = run_hex_to_bgb},
+		{.name = "hex_to_gen/1",      .unit = "item",  .run = run_hex_to_gen1},
+		{.name = "hex_to_gen/2",      .unit = "item",  .run = run_hex_to_gen2},
+		{.name = "hex_to_joy",        .unit = "byte",  .run = run_hex_to_joy},
+	};
+	int bench_count = sizeof(benches) / sizeof(*benches);
+	struct Baseline baseline[64];
+	int baseline_count = 0;
+
+	// Parse arguments
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-size") && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-runs") && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-save") && i + 1 < argc)
+			save = argv[++i];
+		else if (!strcmp(argv[i], "-compare") && i + 1 < argc)
+			compare = argv[++i];
+		else if (!strcmp(argv[i], "-threshold") && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else
+			usage(argv[0]);
+	}
+
+	if (size < 1 || runs < 1)
+		usage(argv[0]);
+
+	if (compare)
+		baseline_count = load_baseline(compare, baseline, sizeof(baseline) / sizeof(*baseline));
+
+	// Build the corpus, and the tables outside of any measurement
+	struct Corpus corpus = {0};
+	init_tables();
+	make_code(&corpus, size << 20);
+	make_hex(&corpus);
+	make_sources(&corpus);
+
+	printf("Corpus: %d instructions in %d bytes, %d-line source (%d bytes), %d-line labeled source (%d bytes)\n\n",
+		corpus.instructions, corpus.code.size, corpus.source_lines, corpus.source_size, corpus.labeled_lines, corpus.labeled_size);
+	printf("%-20s %14s %10s %10s %12s%s\n", "Benchmark", "Units", "ns/unit", "MB/s", "Allocs/run", (compare ? "   vs. baseline" : ""));
+
+	FILE *out = (save ? fopen(save, "w") : NULL);
+	if (save && !out)
+	{
+		printf("Error : couldn't write to \"%s\" !\n", save);
+		exit(1);
+	}
+
+	for (int b = 0; b < bench_count; b++)
+	{
+		struct Bench *bench = &benches[b];
+		double best = 0;
+
+		// The input size is whatever the conversion reads
+		if (bench->prepare == prepare_source)
+		{
+			bench->units = corpus.source_lines;
+			bench->bytes = corpus.source_size;
+		}
+		else if (bench->prepare == prepare_labeled)
+		{
+			bench->units = corpus.labeled_lines;
+			bench->bytes = corpus.labeled_size;
+		}
+		else if (bench->prepare == prepare_hex)
+		{
+			bench->units = corpus.code.size;
+			bench->bytes = corpus.hex_size;
+		}
+		else
+		{
+			bench->units = (!strcmp(bench->unit, "instr") ? corpus.instructions :
+				!strcmp(bench->unit, "item") ? (corpus.code.size + 1) / 2 : corpus.code.size);
+			bench->bytes = corpus.code.size;
+		}
+
+		for (int r = 0; r < runs; r++)
+		{
+			struct Context ctx;
+			long written = 0;
+
+			if (bench->prepare)
+				bench->prepare(&corpus);
+
+			context_init(&ctx);
+			ctx.write = count_sink;
+			ctx.user = &written;
+
+			long allocations_before = allocations;
+			double start = now();
+			bench->run(&ctx, &corpus);
+			double elapsed = now() - start;
+			long allocated = allocations - allocations_before;
+
+			context_free(&ctx);
+
+			// Keep the fastest run, which is the one least disturbed by the
+			// rest of the machine
+			if (!r || elapsed < best)
+			{
+				best = elapsed;
+				bench->allocations = allocated;
+			}
+		}
+
+		bench->ns_per_unit = best * 1e9 / bench->units;
+		bench->mb_per_sec = bench->bytes / best / (1 << 20);
+
+		printf("%-20s %8ld %-5s %10.2f %10.1f ", bench->name, bench->units, bench->unit, bench->ns_per_unit, bench->mb_per_sec);
+#ifdef __GLIBC__
+		printf("%12.0f", bench->allocations);
+#else
+		printf("%12s", "n/a");
+#endif
+
+		// Compare against the saved run of the same benchmark
+		for (int i = 0; i < baseline_count; i++)
+			if (!strcmp(baseline[i].name, bench->name))
+			{
+				double change = (bench->ns_per_unit / baseline[i].ns_per_unit - 1) * 100;
+				printf("   %+7.1f%%", change);
+				if (change > threshold)
+				{
+					printf(" SLOWER");
+					slower++;
+				}
+			}
+		printf("\n");
+
+		if (out)
+			fprintf(out, "%s %f %f %.0f\n", bench->name, bench->ns_per_unit, bench->mb_per_sec, bench->allocations);
+	}
+
+	if (out)
+		fclose(out);
+
+	if (slower)
+	{
+		printf("\n%d benchmark(s) more than %.0f%% slower than %s\n", slower, threshold, compare);
+		return 1;
+	}
+	return 0;
+}
+
+
+// Print the default help message
+void usage(char *str)
+{
+	printf("Usage: %s [options]\n\n", str);
+	printf("Options:\n");
+	printf("  -size mb       Size of the generated machine code (default 4)\n");
+	printf("  -runs n        Runs per benchmark, the fastest is kept (default 5)\n");
+	printf("  -save file     Save the results for a later -compare\n");
+	printf("  -compare file  Compare against saved results, and fail if any\n");
+	printf("                   benchmark got slower than the threshold\n");
+	printf("  -threshold pct Allowed slowdown for -compare (default 10)\n\n");
+	printf("Examples:\n");
+	printf("  %s -save before.txt\n", str);
+	printf("  %s -compare before.txt\n", str);
+	exit(0);
+}
+
+
+// xorshift32
+unsigned int next_random(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+
+// Output sink that only counts what it's given
+void count_sink(void *user, const char *data, int len)
+{
+	(void)data;
+	*(long*)user += len;
+}
+
+
+// Monotonic time in seconds
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Generates machine code that goes through every regular and CB-prefixed
+// opcode, in a new shuffled order each round, with random arguments
+void make_code(struct Corpus *corpus, int size)
+{
+	int order[512];
+	int count = 0;
+
+	for (int i = 0; i < 512; i++)
+		if (i != 0xCB)
+			order[count++] = i;
+
+	while (corpus->code.size < size)
+	{
+		// Fisher-Yates shuffle
+		for (int i = count - 1; i > 0; i--)
+		{
+			int j = next_random() % (i + 1);
+			int tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+
+		for (int i = 0; i < count && corpus->code.size < size; i++)
+		{
+			unsigned char bytes[3] = {order[i], next_random(), next_random()};
+			if (order[i] > 0xFF)
+			{
+				bytes[0] = 0xCB;
+				bytes[1] = order[i] & 0xFF;
+			}
+
+			buffer_append(&corpus->code, bytes, instruction_size(bytes, 3));
+			corpus->instructions++;
+		}
+	}
+}
+
+
+// Renders the machine code as a hex dump
+void make_hex(struct Corpus *corpus)
+{
+	corpus->hex_size = corpus->code.size * 2;
+	corpus->hex = malloc(corpus->hex_size + 1);
+	hex_encode(corpus->hex, corpus->code.data, corpus->code.size);
+	corpus->hex[corpus->hex_size] = 0;
+}
+
+
+// Builds assembly sources by disassembling the machine code. Opcodes that
+// don't exist can't be assembled back, so their lines are left out.
+//
+// The labeled source puts a label before every 8th instruction, and jumps to
+// them: jr to the neighbouring labels, jp and call to labels anywhere.
+void make_sources(struct Corpus *corpus)
+{
+	struct Context ctx;
+	struct Buffer listing = {0};
+	struct Buffer source = {0};
+	struct Buffer labeled = {0};
+	char line[64];
+
+	context_init(&ctx);
+	ctx.write = buffer_sink;
+	ctx.user = &listing;
+	hex_to_asm(&ctx, corpus->code.data, corpus->code.size, 0);
+	context_free(&ctx);
+	buffer_append(&listing, (unsigned char*)"", 1);
+
+	int labels = corpus->instructions / 8 + 1;
+	int block = 0;
+	char *text = (char*)listing.data;
+
+	// Skip the header
+	for (int i = 0; i < 3; i++)
+		text = strchr(text, '\n') + 1;
+
+	for (int pos = 0; pos < corpus->code.size;)
+	{
+		char *end = strchr(text, '\n');
+		int size = instruction_size(corpus->code.data + pos, corpus->code.size - pos);
+		pos += size;
+
+		// Skip the offset and the bytes to get to the instruction
+		char *c = text;
+		for (int token = 0; token <= size; token++)
+		{
+			for (; *c == ' '; c++);
+			for (; *c != ' '; c++);
+		}
+		for (; *c == ' '; c++);
+
+		// Cut the trailing spaces
+		char *last = end;
+		for (; last > c && last[-1] == ' '; last--);
+		*last = 0;
+		text = end + 1;
+
+		if (!strcmp(c, "-"))
+			continue;
+
+		int len = snprintf(line, sizeof(line), "%s\n", c);
+		buffer_append(&source, (unsigned char*)line, len);
+		corpus->source_lines++;
+
+		if (corpus->source_lines % 8 == 1)
+		{
+			len = snprintf(line, sizeof(line), (block & 1 ? ".l%d\n" : "l%d:\n"), block);
+			buffer_append(&labeled, (unsigned char*)line, len);
+			corpus->labeled_lines++;
+
+			// Jumps within range of jr: back to this label or ahead to the
+			// next one. Anything goes for jp and call.
+			switch (next_random() % 4)
+			{
+				case 0: len = snprintf(line, sizeof(line), "jr l%d\n", block); break;
+				case 1: len = snprintf(line, sizeof(line), "jr nz,l%d\n", (block + 1 < labels ? block + 1 : block)); break;
+				case 2: len = snprintf(line, sizeof(line), "jp c,l%d\n", next_random() % labels); break;
+				case 3: len = snprintf(line, sizeof(line), "call l%d\n", next_random() % labels); break;
+			}
+			buffer_append(&labeled, (unsigned char*)line, len);
+			corpus->labeled_lines++;
+			block++;
+		}
+
+		len = snprintf(line, sizeof(line), "%s\n", c);
+		buffer_append(&labeled, (unsigned char*)line, len);
+		corpus->labeled_lines++;
+	}
+
+	// Define the labels the last blocks jump ahead to
+	for (; block < labels; block++)
+	{
+		int len = snprintf(line, sizeof(line), "l%d:\n", block);
+		buffer_append(&labeled, (unsigned char*)line, len);
+		corpus->labeled_lines++;
+	}
+
+	corpus->source_size = source.size;
+	corpus->labeled_size = labeled.size;
+	buffer_append(&source, (unsigned char*)"", 1);
+	buffer_append(&labeled, (unsigned char*)"", 1);
+	corpus->source = (char*)source.data;
+	corpus->labeled = (char*)labeled.data;
+	free(listing.data);
+
+	int scratch_size = (source.size > labeled.size ? source.size : labeled.size);
+	corpus->scratch = malloc(scratch_size > corpus->hex_size + 1 ? scratch_size : corpus->hex_size + 1);
+}
+
+
+// Copies an input to the scratch buffer before it's parsed
+void prepare_source(struct Corpus *corpus)
+{
+	memcpy(corpus->scratch, corpus->source, corpus->source_size + 1);
+}
+
+void prepare_labeled(struct Corpus *corpus)
+{
+	memcpy(corpus->scratch, corpus->labeled, corpus->labeled_size + 1);
+}
+
+void prepare_hex(struct Corpus *corpus)
+{
+	memcpy(corpus->scratch, corpus->hex, corpus->hex_size + 1);
+}
+
+
+// The benchmarks
+void run_asm_to_hex(struct Context *ctx, struct Corpus *corpus)
+{
+	if (assemble_source(ctx, corpus->scratch) || resolve_labels(ctx))
+	{
+		printf("Error : the corpus didn't assemble: %s\n", ctx->error);
+		exit(1);
+	}
+}
+
+void run_parse_hex(struct Context *ctx, struct Corpus *corpus)
+{
+	parse_hex(ctx, corpus->scratch, &ctx->machine_code);
+}
+
+void run_print_hex(struct Context *ctx, struct Corpus *corpus)
+{
+	print_hex(ctx, corpus->code.data, corpus->code.size);
+}
+
+void run_hex_to_asm(struct Context *ctx, struct Corpus *corpus)
+{
+	hex_to_asm(ctx, corpus->code.data, corpus->code.size, 0);
+}
+
+void run_hex_to_bgb(struct Context *ctx, struct Corpus *corpus)
+{
+	hex_to_asm(ctx, corpus->code.data, corpus->code.size, 1);
+}
+
+void run_hex_to_gen1(struct Context *ctx, struct Corpus *corpus)
+{
+	hex_to_gen(ctx, corpus->code.data, corpus->code.size, 1);
+}
+
+void run_hex_to_gen2(struct Context *ctx, struct Corpus *corpus)
+{
+	hex_to_gen(ctx, corpus->code.data, corpus->code.size, 2);
+}
+
+void run_hex_to_joy(struct Context *ctx, struct Corpus *corpus)
+{
+	hex_to_joy(ctx, corpus->code.data, corpus->code.size);
+}
+
+
+// Reads the results of a -save run. Returns how many were read.
+int load_baseline(char *filename, struct Baseline *baseline, int max)
+{
+	FILE *file = fopen(filename, "r");
+	int count = 0;
+
+	if (!file)
+	{
+		printf("Error : specified file \"%s\" does not exist !\n", filename);
+		exit(1);
+	}
+
+	while (count < max && fscanf(file, "%31s %lf %*f %*f", baseline[count].name, &baseline[count].ns_per_unit) == 2)
+		count++;
+
+	fclose(file);
+	return count;
+}
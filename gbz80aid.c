@@ -1,71 +1,126 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include "gbz80aid.h"
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#endif
+#include "libgbz80aid.h"
+
+// Struct for holding one job of a batch and its rendered output
+struct Job {
+	char *line;
+	char id[64];
+	struct Buffer output;
+	int result;
+	char done;
+};
 
+// Struct for holding the shared state of a batch. Jobs live in a ring of
+// window slots, between the next one to print and the last one read.
+struct Batch {
+	FILE *manifest;
+	struct Context *options;
+	struct Job *jobs;
+	int window;
+	int count;
+	int next;
+	int written;
+	char finished;
+	pthread_mutex_t lock;
+	pthread_cond_t update;
+};
 
-void usage(char*);
-void strip_spaces(char*);
-void lowercase(char*);
-void uppercase(char*);
-void nullify_char(char*, char);
-char* normalize_param(char*);
-void ascii2hex(char*, int);
-void jump2addr(char*, int);
-char* op2hex(char*, char*, char*);
-void hex_to_asm(char*, int);
-void asm_to_hex(char*);
-void hex_to_gen(char*, int);
-void hex_to_joy(char*);
-
-
-// Struct for holding label information
-struct Label {
-	unsigned int address;
-	char *name;
+// Struct for holding one client connection of the server
+struct Connection {
+	int fd;
+	struct Context *options;
 };
 
-// Struct for holding error detections
-struct Error {
-	unsigned char key_quantity;
-	unsigned char duplicates;
-	unsigned char glitches;
+// Struct for holding one output in the cache, and when it was last used
+struct CacheEntry {
+	char name[33];
+	struct timespec used;
+	long size;
 };
 
+// Version of the tool. Cached output is keyed by it, so it has to be bumped
+// whenever any output changes, or old caches will keep serving the old one.
+#define VERSION "1.3"
 
-// Global offset of current byte
-int cur_offset = 0;
+// Default size the cache is kept under, in bytes
+#define CACHE_SIZE (64L << 20)
 
-// Offset to begin calulating at
-int print_offset = 0;
+// Temporary cache files older than this (in seconds) were left by runs that
+// died while writing them
+#define CACHE_TEMP_AGE 3600
 
-// Ability to define multiple labels
-int jmp_num = 0;
-struct Label *label;
+#define ROTATE_64(x, n) ((x) << (n) | (x) >> (64 - (n)))
 
-// File line offset
-int line_num = 1;
+// How often a watched file is checked for changes, in microseconds
+#define WATCH_INTERVAL 100000
 
-// Read 6 chars at a time
-int hex_size = 1;
-char *hex_string;
+// Largest request the server accepts
+#define MAX_REQUEST_SIZE (64 << 20)
 
-// Show warnings by default
-char show_warnings = 1;
+void usage(char*);
+FILE* open_binary(char*);
+int convert(struct Context*, char*, char*, char);
+int print_output(struct Context*, char*);
+void print_format(struct Context*, char*);
+int has_format(char*, char*);
+int cached_convert(struct Context*, char*, char*, char);
+void cache_store(struct Context*, char*, struct Buffer*);
+void cache_evict(char*, long);
+int compare_entries(const void*, const void*);
+void hash_128(const unsigned char*, int, unsigned long long*);
+unsigned long long mix_64(unsigned long long);
+void watch_file(struct Context*, char*, char*);
+int same_file(struct stat*, struct stat*);
+void run_job(struct Batch*, struct Job*);
+void* batch_worker(void*);
+void* batch_reader(void*);
+int run_batch(struct Context*, char*);
+void copy_options(struct Context*, struct Context*);
+int read_full(int, void*, int);
+int write_full(int, void*, int);
+void* serve_connection(void*);
+void serve(struct Context*, char*);
+int request(char*, char*, int, char*, char);
+int parse_registers(unsigned short*, char*);
 
 
 int main(int argc, char* argv[])
 {
 	char *format = 0;
-	char *input, *filename;
+	char *input = 0, *filename = 0;
 	char file_mode = 0;
+	char binary_mode = 0;
+	char *manifest = 0;
+	char *socket_path = 0;
+	char client_mode = 0;
+	char watch_mode = 0;
+	char stream_mode = 0;
+	struct Buffer memory = {0};
+	struct Context ctx;
+
+	context_init(&ctx);
+	ctx.cache_size = CACHE_SIZE;
 
 	// Show help
 	if (argc == 1)
 		usage(argv[0]);
 
 	// Parse arguments
-	for (int i = 0; i < argc; i++)
+	for (int i = 1; i < argc; i++)
 	{
 		// GIVE US DEM FILE
 		if (!strcmp(argv[i], "-f"))
@@ -81,6 +136,18 @@ int main(int argc, char* argv[])
 			}
 		}
 
+		// Raw bytes, straight from a memory dump or ROM
+		else if (!strcmp(argv[i], "-b"))
+		{
+			binary_mode = 1;
+			filename = argv[++i];
+			if(i == argc)
+			{
+				printf("Error : a file to read from is expected after \"-b\" !\n");
+				exit(1);
+			}
+		}
+
 		else if (!strcmp(argv[i], "-o"))
 		{
 			format = argv[++i];
@@ -102,7 +169,7 @@ int main(int argc, char* argv[])
 		else if (!strcmp(argv[i], "-v"))
 		{
 			printf("GBZ80 Aid\n");
-			printf("Version 1.2\n\n");
+			printf("Version " VERSION "\n\n");
 			printf("Created by KernelEquinox\n");
 			printf("Contributions by ISSOtm\n\n");
 			printf("Homepage : http://github.com/KernelEquinox/8F-Helper/\n\n");
@@ -111,13 +178,13 @@ int main(int argc, char* argv[])
 
 		else if (!strcmp(argv[i], "-ofs"))
 		{
-			if (i++ == argc)
+			if (++i == argc)
 			{
 				printf("Error : \"-ofs\" expects an offset but nothing was found !\n");
 				exit(1);
 			}
 			
-			if (!sscanf(argv[i], "%4X", &print_offset))
+			if (!sscanf(argv[i], "%4X", &ctx.offset))
 			{
 				printf("Error : \'-ofs\" expects an hexadecimal offset (ie. D322 or 1f49)\n");
 				exit(1);
@@ -125,657 +192,1334 @@ int main(int argc, char* argv[])
 		}
 
 		else if (!strcmp(argv[i], "-w"))
-			show_warnings = 0;
+			ctx.show_warnings = 0;
+
+		else if (!strcmp(argv[i], "-j"))
+		{
+			if (++i == argc || !sscanf(argv[i], "%d", &ctx.thread_count) || ctx.thread_count < 0)
+			{
+				printf("Error : \"-j\" expects a number of threads (0 for one per core)\n");
+				exit(1);
+			}
+
+			if (!ctx.thread_count)
+				ctx.thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+
+		else if (!strcmp(argv[i], "-trace"))
+			ctx.trace = 1;
+
+		else if (!strcmp(argv[i], "-e"))
+		{
+			if (ctx.entry_count == sizeof(ctx.entry_points) / sizeof(*ctx.entry_points))
+			{
+				printf("Error : too many entry points !\n");
+				exit(1);
+			}
+
+			if (++i == argc || !sscanf(argv[i], "%X", &ctx.entry_points[ctx.entry_count++]))
+			{
+				printf("Error : \"-e\" expects an hexadecimal address (ie. 0150 or D322)\n");
+				exit(1);
+			}
+			ctx.trace = 1;
+		}
+
+		else if (!strcmp(argv[i], "-batch"))
+		{
+			manifest = argv[++i];
+			if(i == argc)
+			{
+				printf("Error : a manifest to read jobs from is expected after \"-batch\" !\n");
+				exit(1);
+			}
+		}
+
+		else if (!strcmp(argv[i], "-serve") || !strcmp(argv[i], "-connect"))
+		{
+			client_mode = (argv[i][1] == 'c');
+			socket_path = argv[++i];
+			if(i == argc)
+			{
+				printf("Error : a socket path is expected after \"%s\" !\n", argv[i - 1]);
+				exit(1);
+			}
+		}
+
+		else if (!strcmp(argv[i], "-c"))
+			ctx.cycles = 1;
+
+		else if (!strcmp(argv[i], "-O"))
+			ctx.optimize = 1;
+
+		else if (!strcmp(argv[i], "-relax"))
+			ctx.relax = 1;
+
+		else if (!strcmp(argv[i], "-solve"))
+			ctx.solve = 1;
+
+		else if (!strcmp(argv[i], "-slots"))
+		{
+			if (++i == argc || !sscanf(argv[i], "%d", &ctx.slots) || ctx.slots < 1)
+			{
+				printf("Error : \"-slots\" expects a number of item slots (ie. 20 for the bag)\n");
+				exit(1);
+			}
+		}
+
+		else if (!strcmp(argv[i], "-joycost"))
+		{
+			int *c = ctx.joy_costs;
+			if (++i == argc || sscanf(argv[i], "%d,%d,%d,%d,%d,%d,%d,%d", c, c + 1, c + 2, c + 3, c + 4, c + 5, c + 6, c + 7) != 8 ||
+				c[0] < 1 || c[1] < 1 || c[2] < 1 || c[3] < 1 || c[4] < 1 || c[5] < 1 || c[6] < 1 || c[7] < 1)
+			{
+				printf("Error : \"-joycost\" expects 8 costs of at least 1 (DOWN,UP,LEFT,RIGHT,START,SELECT,B,A)\n");
+				exit(1);
+			}
+		}
+
+		else if (!strcmp(argv[i], "-watch"))
+			watch_mode = 1;
+
+		else if (!strcmp(argv[i], "-s"))
+			stream_mode = 1;
+
+		else if (!strcmp(argv[i], "-run"))
+			ctx.run = 1;
+
+		else if (!strcmp(argv[i], "-mem"))
+		{
+			if (++i == argc)
+			{
+				printf("Error : a memory image is expected after \"-mem\" !\n");
+				exit(1);
+			}
+			FILE *file = open_binary(argv[i]);
+			read_binary(file, &memory);
+			if (file != stdin)
+				fclose(file);
+			ctx.memory = memory.data;
+			ctx.memory_size = memory.size;
+		}
+
+		else if (!strcmp(argv[i], "-regs"))
+		{
+			if (++i == argc || !parse_registers(ctx.registers, argv[i]))
+			{
+				printf("Error : \"-regs\" expects hexadecimal registers (ie. a=3E,hl=C000,sp=DFFF)\n");
+				exit(1);
+			}
+		}
+
+		else if (!strcmp(argv[i], "-limit"))
+		{
+			if (++i == argc || !sscanf(argv[i], "%ld", &ctx.run_limit) || ctx.run_limit < 1)
+			{
+				printf("Error : \"-limit\" expects a number of M-cycles (ie. 17556 for a frame)\n");
+				exit(1);
+			}
+		}
+
+		else if (!strcmp(argv[i], "-cache"))
+		{
+			ctx.cache_dir = argv[++i];
+			if(i == argc)
+			{
+				printf("Error : a directory to cache output in is expected after \"-cache\" !\n");
+				exit(1);
+			}
+		}
+
+		else if (!strcmp(argv[i], "-cachesize"))
+		{
+			if (++i == argc || !sscanf(argv[i], "%ld", &ctx.cache_size) || ctx.cache_size < 1)
+			{
+				printf("Error : \"-cachesize\" expects a size in MB (ie. 64)\n");
+				exit(1);
+			}
+			ctx.cache_size <<= 20;
+		}
+
+		else if (!strcmp(argv[i], "-chunk"))
+		{
+			if (++i == argc || !sscanf(argv[i], "%X", &ctx.chunk_size) || ctx.chunk_size < 1)
+			{
+				printf("Error : \"-chunk\" expects an hexadecimal size (ie. 4000 for ROM banks)\n");
+				exit(1);
+			}
+		}
 
 		else
 			input = argv[i];
 	}
 
-	// Set the current offset to the specified offset
-	cur_offset = print_offset;
-
 	// Default to asm if no format was selected
 	if (!format)
 		format = "asm";
 
-	// Allocate space for the hex string
-	hex_string = calloc(hex_size, sizeof(char));
+	// The solver rewrites the program for the one item format it's for
+	if (ctx.solve && strchr(format, ','))
+	{
+		printf("Error : \"-solve\" expects a single format (gen1 or gen2) !\n");
+		exit(1);
+	}
 
-	// Parse file as input
-	if (file_mode)
+	// Convert every job in the manifest instead of a single input
+	if (manifest)
 	{
-		FILE* file = fopen(filename, "r");
-		
-		if(!file)
+		int failed = run_batch(&ctx, manifest);
+		context_free(&ctx);
+		return failed;
+	}
+
+	// Serve conversions to other processes until killed
+	if (socket_path && !client_mode)
+		serve(&ctx, socket_path);
+
+	// The server converts with the options it was started with, and only
+	// takes text input
+	if (client_mode)
+	{
+		int costs = 0;
+		for (int b = 0; b < 8; b++)
+			costs |= (ctx.joy_costs[b] != 1);
+
+		if (binary_mode)
 		{
-			printf("Error : specified file \"%s\" does not exist !\n", filename);
+			printf("Error : \"-connect\" sends hex, assembly or a source file, so it can't be used with -b !\n");
+			exit(1);
+		}
+		if (ctx.optimize || ctx.relax || ctx.solve || ctx.cycles || ctx.trace || ctx.entry_count || ctx.run || !ctx.show_warnings || costs)
+		{
+			printf("Error : \"-connect\" uses the server's options, so -O, -relax, -solve, -c, -trace, -e, -run, -w and -joycost go to -serve !\n");
 			exit(1);
 		}
-		
-		char line[256];
-		while (fgets(line, sizeof(line), file))
-			asm_to_hex(line);
-		
-		uppercase(hex_string);
-		input = hex_string;
-		
-		fclose(file);
 	}
 
+	// Keep assembling the file as it's edited, until killed
+	if (watch_mode)
+	{
+		if (!file_mode)
+		{
+			printf("Error : \"-watch\" expects a source file (-f file) !\n");
+			exit(1);
+		}
+		if (ctx.optimize || ctx.relax || ctx.solve)
+		{
+			printf("Error : \"-watch\" can't be used with -O, -relax or -solve !\n");
+			exit(1);
+		}
+		watch_file(&ctx, format, filename);
+	}
+
+	// Convert stdin as it's read, printing output as soon as it's ready
+	if (stream_mode)
+	{
+		if (file_mode || binary_mode || manifest || socket_path || ctx.cache_dir)
+		{
+			printf("Error : \"-s\" reads from stdin, so it can't be used with -f, -b, -batch, -connect or -cache !\n");
+			exit(1);
+		}
+		if (strchr(format, ','))
+		{
+			printf("Error : \"-s\" expects a single format !\n");
+			exit(1);
+		}
+		if (ctx.optimize || ctx.relax || ctx.solve || ctx.cycles || ctx.trace || ctx.run)
+		{
+			printf("Error : \"-s\" can't be used with -O, -relax, -solve, -c, -trace, -e or -run !\n");
+			exit(1);
+		}
+
+		// Every block of output goes straight down the pipe
+		setvbuf(stdout, NULL, _IONBF, 0);
+		ctx.cur_offset = ctx.offset;
+		if ((!strcmp(format, "hex") ? stream_asm(&ctx, stdin) : stream_hex(&ctx, stdin, format)))
+		{
+			printf("\n%s\n", ctx.error);
+			exit(1);
+		}
+		printf("\n");
+		context_free(&ctx);
+		free(memory.data);
+		return 0;
+	}
+
+	// File and binary modes take their input from the file instead
+	if (file_mode || binary_mode)
+		input = filename;
+
+	if (!input)
+	{
+		printf("Error : nothing to convert, give it hex, assembly, -f file or -b file !\n");
+		exit(1);
+	}
+
+	// Have a running server do the conversion
+	if (socket_path)
+		return request(socket_path, format, ctx.offset, input, file_mode);
+
+	char mode = (file_mode ? 'f' : binary_mode ? 'b' : 0);
+	if ((ctx.cache_dir ? cached_convert : convert)(&ctx, format, input, mode))
+	{
+		printf("%s\n", ctx.error);
+		exit(1);
+	}
+
+	context_free(&ctx);
+	free(memory.data);
+	return 0;
+}
+
+
+// Converts the input (hex or assembly, a source file for mode 'f', source
+// text for mode 's', a raw binary for mode 'b', or the machine code already
+// in the context for mode 'm') to the given format, writing to the context's
+// sink
+int convert(struct Context *ctx, char *format, char *input, char mode)
+{
+	int result = GB_OK;
+
+	// Set the current offset to the specified offset
+	ctx->cur_offset = ctx->offset;
+
+	// Search for an equivalent program with no item warnings
+	if (ctx->solve && (!strcmp(format, "gen1") || !strcmp(format, "gen2")))
+	{
+		int gen = format[3] - '0';
+
+		// Source is solved line by line, to keep what it can of it
+		if (mode == 'f')
+		{
+			FILE *file = open_binary(input);
+			read_binary(file, &ctx->machine_code);
+			if (file != stdin)
+				fclose(file);
+			buffer_append(&ctx->machine_code, (unsigned char*)"", 1);
+			result = solve_source(ctx, (char*)ctx->machine_code.data, gen);
+		}
+		else if (mode == 's')
+			result = solve_source(ctx, input, gen);
+		// Machine code is disassembled
+		else
+		{
+			if (mode == 'b')
+			{
+				FILE *file = open_binary(input);
+				read_binary(file, &ctx->machine_code);
+				if (file != stdin)
+					fclose(file);
+			}
+			else if (mode != 'm' && (result = parse_hex(ctx, input, &ctx->machine_code)))
+				return result;
+			result = solve_code(ctx, ctx->machine_code.data, ctx->machine_code.size, gen);
+		}
+
+		if (!result)
+			ctx->write(ctx->user, "\n", 1);
+		return result;
+	}
+
+	// Disassemble raw binary input as it's read, without loading all of it
+	if (mode == 'b' && ctx->thread_count < 2 && !ctx->trace && !ctx->cycles && !ctx->run && (!strcmp(format, "asm") || !strcmp(format, "bgb")))
+	{
+		FILE *file = open_binary(input);
+		stream_to_asm(ctx, file, !strcmp(format, "bgb"));
+		if (file != stdin)
+			fclose(file);
+		ctx->write(ctx->user, "\n", 1);
+		return GB_OK;
+	}
+	// Other formats need the whole binary at once
+	else if (mode == 'b' || mode == 'm')
+	{
+		if (mode == 'm')
+			return print_output(ctx, format);
+		FILE *file = open_binary(input);
+		read_binary(file, &ctx->machine_code);
+		if (file != stdin)
+			fclose(file);
+	}
+	// Parse file as input
+	else if (mode == 'f')
+	{
+		if ((result = assemble_file(ctx, input)) || (result = resolve_labels(ctx)))
+			return result;
+	}
+	// Parse source text as input
+	else if (mode == 's')
+	{
+		if ((result = assemble_source(ctx, input)) || (result = resolve_labels(ctx)))
+			return result;
+	}
+	// Assemble the input line (for every format, when hex is one of them)
+	else if (has_format(format, "hex"))
+	{
+		if ((result = asm_to_hex(ctx, input)) || (result = resolve_labels(ctx)))
+			return result;
+	}
+	// Every other format takes machine code as input
+	else if ((result = parse_hex(ctx, input, &ctx->machine_code)))
+		return result;
+
+	return print_output(ctx, format);
+}
+
+
+// Prints the machine code in the context in each of the given formats
+// (separated by commas), one after the other, or runs it
+int print_output(struct Context *ctx, char *formats)
+{
+	unsigned char *bytes = ctx->machine_code.data;
+	int len = ctx->machine_code.size;
+
+	// Run the code instead of converting it
+	if (ctx->run)
+	{
+		ctx->cur_offset = ctx->offset;
+		int result = run_code(ctx, bytes, len);
+		ctx->write(ctx->user, "\n", 1);
+		return result;
+	}
+
+	for (char *next = formats; next;)
+	{
+		char format[8];
+		char *comma = strchr(next, ',');
+		snprintf(format, sizeof(format), "%.*s", (int)(comma ? comma - next : (int)strlen(next)), next);
+		next = (comma ? comma + 1 : NULL);
+		print_format(ctx, format);
+	}
+	return GB_OK;
+}
+
+
+// Prints the machine code in the context in one format
+void print_format(struct Context *ctx, char *format)
+{
 	// Reset the current offset, since it was probably modified
-	cur_offset = print_offset;
+	ctx->cur_offset = ctx->offset;
+
+	unsigned char *bytes = ctx->machine_code.data;
+	int len = ctx->machine_code.size;
 
 	// Print results
 	if (!strcmp(format, "hex"))
-	{
-		if (!file_mode)
-			asm_to_hex(input);
-		uppercase(hex_string);
-		printf("\nMachine code: %s\n", hex_string);
-	}
+		print_hex(ctx, bytes, len);
 	else if (!strcmp(format, "gen1"))
-		hex_to_gen(input, 1);
+		hex_to_gen(ctx, bytes, len, 1);
 	else if (!strcmp(format, "gen2"))
-		hex_to_gen(input, 2);
+		hex_to_gen(ctx, bytes, len, 2);
 	else if (!strcmp(format, "joy"))
-		hex_to_joy(input);
+		hex_to_joy(ctx, bytes, len);
+	else if (ctx->cycles)
+		timing_to_asm(ctx, bytes, len, !strcmp(format, "bgb"));
+	else if (ctx->trace)
+		trace_to_asm(ctx, bytes, len, !strcmp(format, "bgb"));
+	else if (ctx->thread_count > 1)
+		parallel_to_asm(ctx, bytes, len, !strcmp(format, "bgb"));
 	else if (!strcmp(format, "bgb"))
-		hex_to_asm(input, 1);
+		hex_to_asm(ctx, bytes, len, 1);
 	else
-		hex_to_asm(input, 0);
-	
-	printf("\n");
+		hex_to_asm(ctx, bytes, len, 0);
+
+	ctx->write(ctx->user, "\n", 1);
+}
+
+
+// Checks if a list of formats (separated by commas) has the given one
+int has_format(char *formats, char *format)
+{
+	int len = strlen(format);
+	for (char *next = formats; next; next = strchr(next, ','), next = (next ? next + 1 : NULL))
+		if (!strncmp(next, format, len) && (next[len] == ',' || !next[len]))
+			return 1;
 	return 0;
 }
 
 
-// Print the default help message
-void usage(char *str)
+
+// Converts the input like convert does, through the -cache directory:
+// output rendered before for the same input, format, offset, options and
+// version is written straight from there, and anything new is added to it
+int cached_convert(struct Context *ctx, char *format, char *input, char mode)
 {
-	printf("Usage: %s [options] [hex]\n\n", str);
-	printf("Options:\n");
-	printf("  -f file      File mode (read input from file)\n");
-	printf("  -o format    Display output in a specific format\n");
-	printf("  -ofs offset  Specify memory offset to display in asm format.\n");
-	printf("                 (Ignored in other formats)\n");
-	printf("  -w           Disable item warning messages\n");
-	printf("  -h           Print this help message and exit\n");
-	printf("  -v           Print version information and exit\n\n");
-	printf("Formats:\n");
-	printf("  asm          GB-Z80 assembly language\n");
-	printf("  bgb          BGB-style assembly language\n");
-	printf("  hex          Hexadecimal machine code format\n");
-	printf("  joy          Joypad values\n");
-	printf("  gen1         R/B/Y item codes for use with ACE\n");
-	printf("  gen2         G/S/C item codes for use with ACE\n\n");
-	printf("Examples:\n");
-	printf("  %s EA14D7C9\n", str);
-	printf("  %s -o asm -f bgb_mem.dump\n", str);
-	printf("  %s -o hex -f zzazz.asm\n", str);
-	printf("  %s -o gen1 0E1626642EBB4140CDD635C9\n", str);
-	printf("  %s -o gen2 -f coin_case.asm\n", str);
-	exit(0);
+	struct Buffer key = {0};
+	struct Buffer source = {0};
+	struct Buffer output = {0};
+	unsigned long long hash[2];
+	char path[4096];
+
+	// Files are read first, so what's hashed is exactly what's converted
+	if (mode == 'f' || mode == 'b')
+	{
+		FILE *file = (strcmp(input, "-") ? fopen(input, "rb") : stdin);
+		if (!file)
+			return convert(ctx, format, input, mode);
+		read_binary(file, (mode == 'b' ? &ctx->machine_code : &source));
+		if (file != stdin)
+			fclose(file);
+
+		if (mode == 'f')
+		{
+			buffer_append(&source, (unsigned char*)"", 1);
+			input = (char*)source.data;
+			mode = 's';
+		}
+		else
+			mode = 'm';
+	}
+
+	// Key everything the output depends on
+	int options[] = {mode, ctx->offset, ctx->show_warnings, ctx->trace, ctx->entry_count, ctx->cycles, ctx->optimize,
+		ctx->relax, ctx->solve, ctx->slots, ctx->run, ctx->memory_size};
+	buffer_append(&key, (unsigned char*)"gbz80aid " VERSION, sizeof("gbz80aid " VERSION));
+	buffer_append(&key, (unsigned char*)format, strlen(format) + 1);
+	buffer_append(&key, (unsigned char*)options, sizeof(options));
+	buffer_append(&key, (unsigned char*)ctx->entry_points, ctx->entry_count * sizeof(*ctx->entry_points));
+	buffer_append(&key, (unsigned char*)ctx->joy_costs, sizeof(ctx->joy_costs));
+	buffer_append(&key, (unsigned char*)ctx->registers, sizeof(ctx->registers));
+	buffer_append(&key, (unsigned char*)&ctx->run_limit, sizeof(ctx->run_limit));
+	if (ctx->memory_size)
+		buffer_append(&key, ctx->memory, ctx->memory_size);
+	if (mode == 'm')
+		buffer_append(&key, ctx->machine_code.data, ctx->machine_code.size);
+	else
+		buffer_append(&key, (unsigned char*)input, strlen(input));
+	hash_128(key.data, key.size, hash);
+	free(key.data);
+
+	if (snprintf(path, sizeof(path), "%s/%016llx%016llx", ctx->cache_dir, hash[0], hash[1]) >= (int)sizeof(path))
+	{
+		int result = convert(ctx, format, input, mode);
+		free(source.data);
+		return result;
+	}
+
+	// Cached output is written straight from a mapping of its file, and
+	// marked as used so it's evicted last
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd >= 0 && !fstat(fd, &info))
+	{
+		char *data = (info.st_size ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL);
+		if (data != MAP_FAILED)
+		{
+			futimens(fd, NULL);
+			close(fd);
+			ctx->write(ctx->user, data, info.st_size);
+			if (data)
+				munmap(data, info.st_size);
+			free(source.data);
+			return GB_OK;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	// Anything else is rendered to a buffer, written out, then cached unless
+	// it failed
+	void (*write)(void*, const char*, int) = ctx->write;
+	void *user = ctx->user;
+	ctx->write = buffer_sink;
+	ctx->user = &output;
+	int result = convert(ctx, format, input, mode);
+	ctx->write = write;
+	ctx->user = user;
+
+	if (output.size)
+		ctx->write(ctx->user, (char*)output.data, output.size);
+	if (!result)
+		cache_store(ctx, path, &output);
+
+	free(output.data);
+	free(source.data);
+	return result;
 }
 
 
-// Removes all spaces from the string
-void strip_spaces(char *str)
+// Adds rendered output to the cache. It's written to a temporary file then
+// renamed into place, so nothing ever reads half of it, and the least
+// recently used outputs are evicted until the cache fits in -cachesize.
+void cache_store(struct Context *ctx, char *path, struct Buffer *output)
 {
-	char *modified = str;
-	do
-		while (*modified == ' ' || *modified == '\t')
-			modified++;
-	while ((*str++ = *modified++));
+	char temp[4096 + 8];
+
+	mkdir(ctx->cache_dir, 0777);
+	snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+	int fd = mkstemp(temp);
+	if (fd < 0)
+		return;
+
+	fchmod(fd, 0644);
+	int written = write_full(fd, output->data, output->size);
+	if (close(fd) || !written || rename(temp, path))
+	{
+		unlink(temp);
+		return;
+	}
+
+	cache_evict(ctx->cache_dir, ctx->cache_size);
 }
 
 
-// Converts all uppercase chars to lowercase
-void lowercase(char *str)
+// Deletes the least recently used outputs of a cache until it fits in limit
+// bytes, along with temporary files nothing is writing anymore
+void cache_evict(char *dir, long limit)
 {
-	do
-		if (*str > 0x40 && *str < 0x5B)
-			*str += 0x20;
-	while (*str++);
+	DIR *listing = opendir(dir);
+	struct CacheEntry *entries = NULL;
+	int count = 0;
+	int capacity = 0;
+	long total = 0;
+	time_t now = time(NULL);
+	char path[4096 + 256];
+
+	if (!listing)
+		return;
+
+	for (struct dirent *entry; (entry = readdir(listing));)
+	{
+		char *name = entry->d_name;
+		struct stat info;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		if (name[0] == '.' || stat(path, &info) || !S_ISREG(info.st_mode))
+			continue;
+
+		// Outputs are named after their hash, and temporary files after the
+		// output they're for
+		if (strspn(name, "0123456789abcdef") != 32)
+			continue;
+		if (name[32])
+		{
+			if (name[32] == '.' && now - info.st_mtime > CACHE_TEMP_AGE)
+				unlink(path);
+			continue;
+		}
+
+		if (count == capacity)
+		{
+			capacity = (capacity ? capacity * 2 : 256);
+			entries = realloc(entries, capacity * sizeof(struct CacheEntry));
+		}
+		memcpy(entries[count].name, name, 33);
+		entries[count].used = info.st_mtim;
+		entries[count].size = info.st_size;
+		total += info.st_size;
+		count++;
+	}
+	closedir(listing);
+
+	if (total > limit)
+	{
+		qsort(entries, count, sizeof(struct CacheEntry), compare_entries);
+		for (int i = 0; i < count && total > limit; i++)
+		{
+			snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+			unlink(path);
+			total -= entries[i].size;
+		}
+	}
+
+	free(entries);
 }
 
 
-// Converts all lowercase chars to uppercase
-void uppercase(char *str)
+// Orders cache entries from least to most recently used
+int compare_entries(const void *a, const void *b)
 {
-	do
-		if (*str > 0x60)
-			*str -= 0x20;
-	while (*str++);
+	const struct timespec *x = &((const struct CacheEntry*)a)->used;
+	const struct timespec *y = &((const struct CacheEntry*)b)->used;
+
+	if (x->tv_sec != y->tv_sec)
+		return (x->tv_sec < y->tv_sec ? -1 : 1);
+	return (x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec);
 }
 
 
-// Replaces selected char with a null byte
-void nullify_char(char *str, char target)
+// Hashes data to 128 bits (MurmurHash3, x64 variant), for naming cached
+// output
+void hash_128(const unsigned char *data, int len, unsigned long long *hash)
 {
-	do
-		if (*str == target)
-		{
-			*str = 0;
-			return;
-		}
-	while (*str++);
+	const unsigned long long c1 = 0x87C37B91114253D5ULL;
+	const unsigned long long c2 = 0x4CF5AD432745937FULL;
+	unsigned long long h1 = 0;
+	unsigned long long h2 = 0;
+	unsigned long long k1, k2;
+	int blocks = len / 16;
+
+	for (int i = 0; i < blocks; i++)
+	{
+		memcpy(&k1, data + i * 16, 8);
+		memcpy(&k2, data + i * 16 + 8, 8);
+
+		k1 *= c1;
+		k1 = ROTATE_64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = ROTATE_64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52DCE729;
+
+		k2 *= c2;
+		k2 = ROTATE_64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = ROTATE_64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495AB5;
+	}
+
+	// The last few bytes, which mix in as nothing when there are none
+	const unsigned char *tail = data + blocks * 16;
+	k1 = 0;
+	k2 = 0;
+	for (int i = (len & 15) - 1; i >= 8; i--)
+		k2 = k2 << 8 | tail[i];
+	for (int i = ((len & 15) < 8 ? (len & 15) : 8) - 1; i >= 0; i--)
+		k1 = k1 << 8 | tail[i];
+
+	k2 *= c2;
+	k2 = ROTATE_64(k2, 33);
+	k2 *= c1;
+	h2 ^= k2;
+	k1 *= c1;
+	k1 = ROTATE_64(k1, 31);
+	k1 *= c2;
+	h1 ^= k1;
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = mix_64(h1);
+	h2 = mix_64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	hash[0] = h1;
+	hash[1] = h2;
 }
 
 
-// Changes input values to $xx or $xxyy
-char* normalize_param(char *str)
+// Final mix of a hash, so every input bit affects every output bit
+unsigned long long mix_64(unsigned long long k)
 {
-	char *hex = calloc(5, sizeof(char));
-	do
-		if (*str == '$')
-		{
-			hex[0] = str[1];
-			hex[1] = str[2];
-			str[1] = 'x';
-			str[2] = 'x';
-			if (str[3] > ')')
-			{
-				hex[2] = hex[0];
-				hex[3] = hex[1];
-				hex[0] = str[3];
-				hex[1] = str[4];
-				str[3] = 'y';
-				str[4] = 'y';
-			}
-			break;
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	k *= 0xC4CEB9FE1A85EC53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// Assembles a source file again every time it changes, and prints the
+// output. Only the lines that changed are assembled again.
+void watch_file(struct Context *ctx, char *format, char *filename)
+{
+	struct Watch watch;
+	struct Buffer source = {0};
+	struct stat last, seen;
+
+	memset(&last, 0, sizeof(last));
+	memset(&seen, 0, sizeof(seen));
+	watch_init(&watch);
+	printf("Watching %s (Ctrl+C to stop)\n", filename);
+	fflush(stdout);
+
+	for (;; usleep(WATCH_INTERVAL))
+	{
+		// Wait until it stays the same for a whole poll, so it isn't read
+		// halfway through being saved
+		struct stat info;
+		if (stat(filename, &info) || same_file(&info, &last))
+			continue;
+		if (!same_file(&info, &seen))
+		{
+			seen = info;
+			continue;
 		}
-	while (*str++);
-	return hex;
+
+		FILE *file = fopen(filename, "rb");
+		if (!file)
+			continue;
+		last = info;
+		source.size = 0;
+		read_binary(file, &source);
+		fclose(file);
+
+		int result = watch_update(ctx, &watch, (char*)source.data, source.size);
+		if (!watch.assembled && !watch.removed)
+			continue;
+
+		printf("\n[%s] Line %d on: %d line%s assembled, %d reference%s patched\n", filename, watch.first_changed + 1,
+			watch.assembled, (watch.assembled == 1 ? "" : "s"), watch.resolved, (watch.resolved == 1 ? "" : "s"));
+		if (result || (result = print_output(ctx, format)))
+			printf("%s\n", ctx->error);
+		fflush(stdout);
+	}
 }
 
 
-// Reads hexadecimal written in ASCII, and replaces each character by its value.
-void ascii2hex(char *str, int len)
+// Checks if two stats of a file are of the same version of it
+int same_file(struct stat *a, struct stat *b)
 {
-	char map[256] = {['0'] = 0,
-					 ['1'] = 1,
-					 ['2'] = 2,
-					 ['3'] = 3,
-					 ['4'] = 4,
-					 ['5'] = 5,
-					 ['6'] = 6,
-					 ['7'] = 7,
-					 ['8'] = 8,
-					 ['9'] = 9,
-					 ['A'] = 10,
-					 ['a'] = 10,
-					 ['B'] = 11,
-					 ['b'] = 11,
-					 ['C'] = 12,
-					 ['c'] = 12,
-					 ['D'] = 13,
-					 ['d'] = 13,
-					 ['E'] = 14,
-					 ['e'] = 14,
-					 ['F'] = 15,
-					 ['f'] = 15};
-
-	for (int i = 0; i < len; i++)
-		str[i] = map[str[i]];
+	return a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+		a->st_size == b->st_size && a->st_ino == b->st_ino;
 }
 
 
-// Converts an instruction into its hexadecimal equivalent.
-char* op2hex(char *opcode, char *param, char *args)
+// Runs one job of a batch, in its own context
+void run_job(struct Batch *batch, struct Job *job)
 {
-	char *hex = calloc(7, sizeof(char));
-	char opcode_hex[3];
-	int cb = 0; // Flags if this instruction is CB-prefixed.
-	
-	// Some syntaxes use '[' instead of '('. These being strictly equivalent, we'll replace brackets if we find some.
-	// We'll only look at the first occurence since no instruction uses parentheses twice.
-	char *parenthesis = strchr(param, '[');
-	if(parenthesis)
-	{
-		*parenthesis = '(';
-		
-		parenthesis = strchr(param, ']');
-		if(!parenthesis)
-		{
-			// Please, be consistent.
-			printf("Couldn't parse [%s %s] on line %d\n", opcode, param, line_num);
-			exit(1);
-		}
-		*parenthesis = ')';
+	struct Context ctx;
+	char format[64];
+	int pos = 0;
+	int len = strlen(job->line);
+
+	context_init(&ctx);
+	copy_options(&ctx, batch->options);
+	ctx.write = buffer_sink;
+	ctx.user = &job->output;
+
+	// Cut the line ending
+	while (len && (job->line[len - 1] == '\n' || job->line[len - 1] == '\r'))
+		job->line[--len] = 0;
+
+	// Each job is "id format offset input", where an input starting with @
+	// names a source file
+	if (sscanf(job->line, "%63s %63s %X %n", job->id, format, &ctx.offset, &pos) < 3 || !job->line[pos])
+	{
+		snprintf(ctx.error, sizeof(ctx.error), "Error : job should be \"id format offset input\" but found \"%s\"", job->line);
+		job->result = GB_ERROR_PARSE;
 	}
-	
-	// Scan the list of prefixed instructions.
-	for (int x = 0; x < 11; x++)
-		if (!strcmp(opcode, cb_set[x]))
-		{
-			strcat(hex, "cb");
-			cb = 1;
-		}
+	else if (job->line[pos] == '@')
+		job->result = (ctx.cache_dir ? cached_convert : convert)(&ctx, format, job->line + pos + 1, 'f');
+	else
+		job->result = (ctx.cache_dir ? cached_convert : convert)(&ctx, format, job->line + pos, 0);
 
-	// Check the lookup table for matches
-	for (int i = 0; i < 16; i++)
-		for (int k = 0; k < 16; k++)
-			if ((!strcmp(opcode, cb_opcode_table[i][k]) &&
-				!strcmp(param, cb_param_table[i][k])) ||
-				(!strcmp(opcode, bgb_opcode_table[i][k]) &&
-				!strcmp(param, bgb_param_table[i][k])) ||
-				(!strcmp(opcode, opcode_table[i][k]) &&
-				!strcmp(param, param_table[i][k])))
-			{
-				int index = (i << 4) | k;
-				sprintf(opcode_hex, "%02x", index);
-				strcat(hex, opcode_hex);
-				strcat(hex, args);
-				return hex;
-			}
+	if (job->result)
+	{
+		buffer_append(&job->output, (unsigned char*)ctx.error, strlen(ctx.error));
+		buffer_append(&job->output, (unsigned char*)"\n", 1);
+	}
 
-	// Ollie into the sun if no match
-	printf("Couldn't parse [%s %s] on line %d\n", opcode, param, line_num);
-	exit(1);
+	context_free(&ctx);
 }
 
 
-// Converts a jump label into a jump address
-void jump2addr(char *param, int type)
+// Batch worker thread: takes jobs in order until the manifest runs out
+void* batch_worker(void *arg)
 {
-	for (int i = 0; i < jmp_num; i++)
+	struct Batch *batch = arg;
+
+	pthread_mutex_lock(&batch->lock);
+	for (;;)
 	{
-		if (!strcmp(label[i].name, param))
-		{
-			param[0] = '$';
-			if (type)
-				sprintf(param + 1, "%x", (label[i].address - cur_offset - 2) & 0xFF);
-			else
-				sprintf(param + 1, "%04x", label[i].address);
-			param[(type ? 3 : 5)] = 0;
-		}
+		while (batch->next == batch->count && !batch->finished)
+			pthread_cond_wait(&batch->update, &batch->lock);
+		if (batch->next == batch->count)
+			break;
+
+		struct Job *job = &batch->jobs[batch->next++ % batch->window];
+		pthread_mutex_unlock(&batch->lock);
+
+		run_job(batch, job);
+
+		pthread_mutex_lock(&batch->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&batch->update);
 	}
+	pthread_mutex_unlock(&batch->lock);
+
+	return NULL;
 }
 
 
+// Batch reader thread: queues the manifest's lines as jobs, staying at most
+// one window ahead of the output
+void* batch_reader(void *arg)
+{
+	struct Batch *batch = arg;
+	char *line = NULL;
+	size_t capacity = 0;
 
+	while (getline(&line, &capacity, batch->manifest) > 0)
+	{
+		// Skip blank lines and comments
+		char *c = line;
+		for (; *c == ' ' || *c == '\t'; c++);
+		if (!*c || *c == '\n' || *c == '\r' || *c == '#')
+			continue;
+
+		pthread_mutex_lock(&batch->lock);
+		while (batch->count - batch->written == batch->window)
+			pthread_cond_wait(&batch->update, &batch->lock);
+
+		struct Job *job = &batch->jobs[batch->count % batch->window];
+		memset(job, 0, sizeof(*job));
+		job->line = strdup(c);
+		sprintf(job->id, "%d", batch->count + 1);
+		batch->count++;
+		pthread_cond_broadcast(&batch->update);
+		pthread_mutex_unlock(&batch->lock);
+	}
+	free(line);
+
+	pthread_mutex_lock(&batch->lock);
+	batch->finished = 1;
+	pthread_cond_broadcast(&batch->update);
+	pthread_mutex_unlock(&batch->lock);
+
+	return NULL;
+}
 
 
-// Converts hex to asm and prints the results
-void hex_to_asm(char *str, int bgb)
+// Converts every job in a manifest (or stdin for "-") on a pool of threads.
+// Results are printed in the manifest's order, each one under its job id.
+// Returns 1 if any job failed.
+int run_batch(struct Context *options, char *filename)
 {
-	// Remove spaces and calculate length
-	strip_spaces(str);
-	int len = strlen(str);
+	struct Batch batch = {0};
+	int failed = 0;
 
-	// Make modifiable copy of input string
-	char bytes[len + 1];
-	strcpy(bytes, str);
+	batch.manifest = (strcmp(filename, "-") ? fopen(filename, "r") : stdin);
+	if (!batch.manifest)
+	{
+		printf("Error : specified file \"%s\" does not exist !\n", filename);
+		exit(1);
+	}
 
-	// Translate the hex string into a byte array
-	ascii2hex(str, len);
+	batch.options = options;
+	batch.window = options->thread_count * 4;
+	batch.jobs = calloc(batch.window, sizeof(struct Job));
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.update, NULL);
 
-	printf("\n%sgbz80 Assembly:\n\n", (bgb ? "BGB " : ""));
+	pthread_t reader, threads[options->thread_count];
+	pthread_create(&reader, NULL, batch_reader, &batch);
+	for (int i = 0; i < options->thread_count; i++)
+		pthread_create(&threads[i], NULL, batch_worker, &batch);
 
-	// Loop through each opcode
-	for (int i = 0; i < len;)
+	// Print the jobs in order as they finish
+	pthread_mutex_lock(&batch.lock);
+	for (;;)
 	{
-		// Place horizontal cursor at line start
-		int h_cursor = 0;
+		struct Job *job = &batch.jobs[batch.written % batch.window];
+		while (!(batch.written < batch.count && job->done) && !(batch.finished && batch.written == batch.count))
+			pthread_cond_wait(&batch.update, &batch.lock);
+		if (batch.written == batch.count)
+			break;
+		pthread_mutex_unlock(&batch.lock);
 
-		// Print current offset
-		printf("% 4X  ", cur_offset);
-		h_cursor += 6;
+		printf("[%s]\n", job->id);
+		fwrite(job->output.data, 1, job->output.size, stdout);
+		failed |= (job->result != GB_OK);
+		free(job->line);
+		free(job->output.data);
 
-		// Split high and low nybble as indices
-		char h = str[i++];
-		char l = str[i++];
-		char cb = 0;
+		pthread_mutex_lock(&batch.lock);
+		batch.written++;
+		pthread_cond_broadcast(&batch.update);
+	}
+	pthread_mutex_unlock(&batch.lock);
 
-		// Check if current byte is prefix CB
-		if (h == 0xC && l == 0xB)
-			cb = 1;
+	pthread_join(reader, NULL);
+	for (int i = 0; i < options->thread_count; i++)
+		pthread_join(threads[i], NULL);
 
-		// Print initial opcode
-		printf("%X%X ", h, l);
-		cur_offset++;
-		h_cursor += 3;
+	if (batch.manifest != stdin)
+		fclose(batch.manifest);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.update);
+	free(batch.jobs);
 
-		// Print next byte for CB opcodes
-		if (cb)
-		{
-			h = str[i++];
-			l = str[i++];
-			printf("%X%X ", h, l);
-			cur_offset++;
-			h_cursor += 3;
-		}
+	return failed;
+}
 
-		// Special case for the STOP instruction
-		if (h == 1 && l == 0)
-		{
-			printf("01 ");
-			cur_offset++;
-			h_cursor += 3;
-			i += 2;
-		}
 
-		// Mnemonic formatting variables
-		char *instruction;
-		int param_len = 0;
-		int arg_size = 0;
-		int offset = 0;
+// Copies the conversion options (not the state) of one context to another
+void copy_options(struct Context *ctx, struct Context *options)
+{
+	ctx->show_warnings = options->show_warnings;
+	ctx->chunk_size = options->chunk_size;
+	ctx->trace = options->trace;
+	ctx->entry_count = options->entry_count;
+	ctx->cycles = options->cycles;
+	ctx->optimize = options->optimize;
+	ctx->relax = options->relax;
+	ctx->run = options->run;
+	ctx->memory = options->memory;
+	ctx->memory_size = options->memory_size;
+	ctx->run_limit = options->run_limit;
+	memcpy(ctx->registers, options->registers, sizeof(ctx->registers));
+	ctx->solve = options->solve;
+	ctx->slots = options->slots;
+	memcpy(ctx->joy_costs, options->joy_costs, sizeof(ctx->joy_costs));
+	memcpy(ctx->entry_points, options->entry_points, sizeof(ctx->entry_points));
+	ctx->cache_dir = options->cache_dir;
+	ctx->cache_size = options->cache_size;
+}
+
+
+// Reads exactly len bytes from a socket. Returns 0 if it closed first.
+int read_full(int fd, void *data, int len)
+{
+	for (int pos = 0, got; pos < len; pos += got)
+		if ((got = read(fd, (char*)data + pos, len - pos)) <= 0)
+			return 0;
+	return 1;
+}
+
+
+// Writes exactly len bytes to a socket. Returns 0 if it closed first.
+int write_full(int fd, void *data, int len)
+{
+	for (int pos = 0, put; pos < len; pos += put)
+		if ((put = write(fd, (char*)data + pos, len - pos)) <= 0)
+			return 0;
+	return 1;
+}
+
 
-		if (cb)
+// Server thread: answers one client's requests until it disconnects.
+//
+// A request is a 4-byte big-endian length followed by "format offset\n" and
+// the input, which is the same hex or assembly line the command line takes.
+// "format offset source\n" marks the input as a whole assembly source file.
+// The response is a 4-byte big-endian length followed by a result code byte
+// (0 on success) and the output, or the error message.
+void* serve_connection(void *arg)
+{
+	struct Connection *conn = arg;
+	unsigned char header[5];
+
+	while (read_full(conn->fd, header, 4))
+	{
+		unsigned int len = header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+		if (len > MAX_REQUEST_SIZE)
+			break;
+
+		char *data = malloc(len + 1);
+		if (!read_full(conn->fd, data, len))
 		{
-			instruction = cb_opcode_table[h][l];
-			param_len = strlen(cb_param_table[h][l]) + 1;
+			free(data);
+			break;
 		}
-		else if (bgb)
+		data[len] = 0;
+
+		struct Context ctx;
+		struct Buffer output = {0};
+		char format[64];
+		char source[8] = {0};
+		int pos = 0;
+		int result;
+
+		context_init(&ctx);
+		copy_options(&ctx, conn->options);
+		ctx.write = buffer_sink;
+		ctx.user = &output;
+
+		// Split the header line from the input
+		char *input = strchr(data, '\n');
+		if (input)
+			*input++ = 0;
+
+		if (!input || sscanf(data, "%63s %X%n %7s", format, &ctx.offset, &pos, source) < 2 || (*source && strcmp(source, "source")))
 		{
-			instruction = bgb_opcode_table[h][l];
-			param_len = strlen(bgb_param_table[h][l]) + 1;
-			arg_size = size_table[h][l];
-			offset = bgb_offset_table[h][l];
+			snprintf(ctx.error, sizeof(ctx.error), "Error : request should start with \"format offset\" but found \"%s\"", data);
+			result = GB_ERROR_PARSE;
 		}
 		else
+			result = (ctx.cache_dir ? cached_convert : convert)(&ctx, format, input, (*source ? 's' : 0));
+
+		if (result)
 		{
-			instruction = opcode_table[h][l];
-			param_len = strlen(param_table[h][l]) + 1;
-			arg_size = size_table[h][l];
-			offset = offset_table[h][l];
+			output.size = 0;
+			buffer_append(&output, (unsigned char*)ctx.error, strlen(ctx.error));
 		}
 
-		// Create modifiable copy of parameter string
-		char *parameters = malloc(param_len * sizeof(char));
-		memset(parameters, 0, param_len);
-		if (cb)
-			strcpy(parameters, cb_param_table[h][l]);
-		else if (bgb)
-			strcpy(parameters, bgb_param_table[h][l]);
-		else
-			strcpy(parameters, param_table[h][l]);
+		len = output.size + 1;
+		header[0] = len >> 24;
+		header[1] = len >> 16;
+		header[2] = len >> 8;
+		header[3] = len;
+		header[4] = result;
 
-		// Modify mnemonic string if required
-		for (int x = 0; x < (arg_size * 2); x++)
-		{
-			// Swap endianness if necessary
-			if (arg_size == 2)
-				parameters[offset + ((x + 2) % 4)] = bytes[i];
-			else
-				parameters[offset + x] = bytes[i];
-			printf("%X", str[i++]);
-			if (x % 2)
-			{
-				printf(" ");
-				cur_offset++;
-				h_cursor += 3;
-			}
-		}
+		int sent = write_full(conn->fd, header, 5) && write_full(conn->fd, output.data, output.size);
 
-		// Uniformly print mnemonics
-		for (; h_cursor < 23; h_cursor++)
-			printf(" ");
-		printf("%s", instruction);
-		h_cursor += strlen(instruction);
+		free(output.data);
+		free(data);
+		context_free(&ctx);
 
-		for (; h_cursor < 28; h_cursor++)
-			printf(" ");
-		printf("%s\n", parameters);
+		if (!sent)
+			break;
 	}
+
+	close(conn->fd);
+	free(conn);
+	return NULL;
 }
 
 
-void asm_to_hex(char *str)
+// Listens on a Unix socket and serves each client on its own thread.
+// Does not return.
+void serve(struct Context *options, char *path)
 {
-	int i = 0;
-	int len = 0;
-	char opcode[5] = {0};
-	char *param;
-	char *param2, *args;
-
-	// Convert to lowercase and calculate line length
-	lowercase(str);
-	len = strlen(str);
-
-	// Trim leading spaces
-	for (; str[i] == '\t' || str[i] == ' '; i++);
+	struct sockaddr_un addr = {0};
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-	// Force comments and newlines to null bytes
-	nullify_char(str, '\n');
-	nullify_char(str, '\r');
-	nullify_char(str, ';');
-
-	// No instruction on this line
-	if (!str[i])
+	if (strlen(path) >= sizeof(addr.sun_path))
 	{
-		line_num++;
-		return;
+		printf("Error : socket path \"%s\" is too long !\n", path);
+		exit(1);
 	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// Replace the socket of a previous server
+	unlink(path);
 
-	// Update the label array if a label was detected
-	if (str[i] == '.' || strchr(str, ':'))
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 64))
 	{
-		strip_spaces(str);
-		nullify_char(str, ':');
-		// Dynamically expand array as needed
-		label = realloc(label, (jmp_num + 1) * sizeof(*label));
-		// Add current address and label name to array
-		label[jmp_num].address = cur_offset;
-		label[jmp_num].name = calloc(len, sizeof(char));
-		strcpy(label[jmp_num++].name, (str[i] == '.' ? str + 1 : str));
-		line_num++;
-		return;
+		printf("Error : couldn't listen on \"%s\" !\n", path);
+		exit(1);
 	}
 
-	// Fetch the instruction
-	for (int k = 0; str[i] > 0x20;)
-		opcode[k++] = str[i++];
-
-	// Remove all the remaining spaces
-	strip_spaces(str + i);
-
-	// Detect comma location and parse accordingly
-	char *comma = strchr(str, ',');
-	if (opcode[0] == 'j')
-		if (comma)
-	 		jump2addr(comma + 1, (opcode[1] == 'r' ? 1 : 0));
-	 	else
-	 		jump2addr(str + i, (opcode[1] == 'r' ? 1 : 0));
-	args = normalize_param(str);
+	// Clients that hang up mid-response shouldn't take the server with them
+	signal(SIGPIPE, SIG_IGN);
 
-	// The rest of the string is parameter data
-	param = calloc(len, sizeof(char));
-	strcpy(param, str + i);
+	// Build the tables now rather than on the first request
+	init_tables();
 
-	// Special case for the STOP instruction
-	if (!strcmp(opcode, "stop"))
+	for (;;)
 	{
-		free(args);
-		args = "01";
-	}
-	
-	// Get hex equivalent of instruction
-	char *cur_hex = op2hex(opcode, param, args);
-
-	// Resize hex string to hold additional hex values
-	hex_string = realloc(hex_string, (hex_size += strlen(cur_hex)) * sizeof(char));
+		int client = accept(fd, NULL, NULL);
+		if (client < 0)
+			continue;
 
-	// Append instruction hex to output hex string
-	strcat(hex_string, cur_hex);
+		struct Connection *conn = malloc(sizeof(struct Connection));
+		conn->fd = client;
+		conn->options = options;
 
-	// These are for jump correction and error handling
-	cur_offset += strlen(cur_hex) / 2;
-	line_num++;
-	
-	// Free allocated string as it goes out of scope.
-	if(strcmp(opcode, "stop"))
-		free(args);
+		pthread_t thread;
+		pthread_create(&thread, NULL, serve_connection, conn);
+		pthread_detach(thread);
+	}
 }
 
 
-// Converts hex string into Gen I items for 8F
-void hex_to_gen(char *str, int gen)
+// Sends one conversion to a server and prints its response. Source files are
+// read here and sent whole. Returns the exit status.
+int request(char *path, char *format, int offset, char *input, char file_mode)
 {
-	// Error handler for weird item setups
-	struct Error errors = {0};
+	struct sockaddr_un addr = {0};
+	struct Buffer data = {0};
+	char header[32];
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-	strip_spaces(str);
-	int len = strlen(str);
-	unsigned char seen_items[16][16] = {0};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-	// Warning placeholders
-	unsigned char glitch_items = 0;
-	unsigned char multi_key_items = 0;
-	unsigned char duplicate_items = 0;
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+	{
+		printf("Error : couldn't connect to \"%s\" !\n", path);
+		exit(1);
+	}
 
-	printf("\nItem            Quantity\n");
-	printf("========================\n");
+	// The frame length goes first, once the rest is known
+	buffer_append(&data, (unsigned char*)"\0\0\0\0", 4);
+	int len = sprintf(header, "%s %X%s\n", format, offset, (file_mode ? " source" : ""));
+	buffer_append(&data, (unsigned char*)header, len);
 
-	for (int i = 0; i < len;)
+	if (file_mode)
 	{
-		// Prep bytes for lookup
-		ascii2hex(str + i, 2);
+		FILE *file = (strcmp(input, "-") ? fopen(input, "r") : stdin);
+		if (!file)
+		{
+			printf("Error : specified file \"%s\" does not exist !\n", input);
+			exit(1);
+		}
+		read_binary(file, &data);
+		if (file != stdin)
+			fclose(file);
+	}
+	else
+		buffer_append(&data, (unsigned char*)input, strlen(input));
 
-		// Place horizontal cursor at line start
-		int h_cursor = 0;
-		char h = str[i++];
-		char l = str[i++];
-		char *item = (gen == 1 ? gen1_items[h][l] : gen2_items[h][l]);
-		char *quantity = calloc(4, sizeof(char));
-		unsigned char conversion = 0;
+	len = data.size - 4;
+	data.data[0] = len >> 24;
+	data.data[1] = len >> 16;
+	data.data[2] = len >> 8;
+	data.data[3] = len;
 
-		h_cursor += strlen(item);
+	unsigned char response[5];
+	if (!write_full(fd, data.data, data.size) || !read_full(fd, response, 5))
+	{
+		printf("Error : the server at \"%s\" hung up !\n", path);
+		exit(1);
+	}
 
-		// Grab next byte as quantity
-		if (str[i])
+	// Stream the output through as it arrives
+	len = (response[0] << 24 | response[1] << 16 | response[2] << 8 | response[3]) - 1;
+	char block[65536];
+	for (int got; len > 0; len -= got)
+	{
+		if ((got = read(fd, block, (len < (int)sizeof(block) ? len : (int)sizeof(block)))) <= 0)
 		{
-			ascii2hex(str + i, 2);
-			conversion = str[i++] << 4;
-			conversion |= str[i++];
-			sprintf(quantity, "%d", conversion);
+			printf("Error : the server at \"%s\" hung up !\n", path);
+			exit(1);
 		}
-		// Set as "Any" if any quantity will do
-		else
-			quantity = "Any";
-
-		// Print item/quantity pairs
-		printf("%s", item);
-		for (; h_cursor < 16; h_cursor++)
-			printf(" ");
-		printf("x%s\n", quantity);
-
-		// [Error] Key items with 2+ quantity
-		if ((gen == 1 ? gen1_key_items[h][l] : gen2_key_items[h][l]))
-			if (conversion && conversion != 1)
-				errors.key_quantity = 1;
-		// [Error] Invalid or glitch items
-		if ((gen == 1 ? gen1_glitch_items[h][l] : gen2_glitch_items[h][l]))
-			errors.glitches = 1;
-		// [Error] Duplicate item stacks
-		if (seen_items[h][l] == 1)
-			errors.duplicates = 1;
-		else
-			seen_items[h][l] = 1;
+		fwrite(block, 1, got, stdout);
 	}
 
-	// Print errors
-	if (show_warnings)
-		if (errors.key_quantity || errors.glitches || errors.duplicates)
-		{
-			printf("\n\n-- WARNING! --\n");
-			if (errors.duplicates)
-				printf(" * Duplicate item stacks detected!\n");
-			if (errors.key_quantity)
-				printf(" * Key item with 2+ quantity detected!\n");
-			if (errors.glitches)
-				printf(" * Invalid and/or glitch items detected!\n");
-		}
+	close(fd);
+	free(data.data);
+
+	// Errors come back as just the message
+	if (response[4])
+	{
+		printf("\n");
+		return 1;
+	}
+	return 0;
 }
 
-// Converts hex string into joypad values for use with Full Control method
-// http://forums.glitchcity.info/index.php?topic=7744.0
-void hex_to_joy(char* str)
+
+// Print the default help message
+void usage(char *str)
 {
-	strip_spaces(str);
-	int len = strlen(str);
-	ascii2hex(str, len);
+	printf("Usage: %s [options] [hex]\n\n", str);
+	printf("Options:\n");
+	printf("  -f file      File mode (read input from file, or - for stdin)\n");
+	printf("  -b file      Binary mode (read raw bytes from a dump or ROM)\n");
+	printf("  -o formats   Display output in one or more formats (ie. hex,gen1)\n");
+	printf("  -ofs offset  Specify memory offset to display in asm format.\n");
+	printf("                 (Ignored in other formats)\n");
+	printf("  -w           Disable item warning messages\n");
+	printf("  -j threads   Disassemble on multiple threads (0 for one per core)\n");
+	printf("  -chunk size  Hexadecimal size of each thread's share (default 4000)\n");
+	printf("  -trace       Only disassemble code reachable from the entry points\n");
+	printf("                 (The -ofs offset, and rst vectors for ROMs)\n");
+	printf("  -e address   Add an entry point for -trace (can be repeated)\n");
+	printf("  -c           Show the M-cycles each instruction takes, and the\n");
+	printf("                 fastest and slowest paths from the entry points\n");
+	printf("  -O           Shrink assembled code without changing what it does\n");
+	printf("  -relax       Assemble each label jump as jr or jp, whichever is shorter\n");
+	printf("                 (\"jp!\" and \"jr!\" keep the one they were written with)\n");
+	printf("  -s           Stream mode (convert stdin as it's read, printing\n");
+	printf("                 output as soon as each part of it is ready)\n");
+	printf("  -watch       Assemble the -f file again every time it changes\n");
+	printf("  -run         Run the code at the -ofs offset instead of converting it\n");
+	printf("  -mem file    Memory image to run the code in (loaded at 0000)\n");
+	printf("  -regs list   Registers to run the code with (ie. a=3E,hl=C000)\n");
+	printf("  -limit n     M-cycles the code may run for (default 1053360)\n");
+	printf("  -solve       Rewrite gen1/gen2 payloads so no item warnings are left\n");
+	printf("                 (-j threads search in parallel)\n");
+	printf("  -slots n     Item slots -solve may fill (default 20)\n");
+	printf("  -joycost list\n");
+	printf("               Cost of each button for joy output, in the order\n");
+	printf("                 DOWN,UP,LEFT,RIGHT,START,SELECT,B,A (default all 1)\n");
+	printf("  -cache dir   Keep output in a directory, to reuse for the same input\n");
+	printf("  -cachesize n MB the -cache directory may hold (default 64)\n");
+	printf("  -batch file  Convert every \"id format offset input\" line of a\n");
+	printf("                 manifest (or - for stdin), -j jobs at a time\n");
+	printf("  -serve path  Serve conversions on a Unix socket until killed\n");
+	printf("  -connect path\n");
+	printf("               Have the server on that socket do the conversion\n");
+	printf("  -h           Print this help message and exit\n");
+	printf("  -v           Print version information and exit\n\n");
+	printf("Formats:\n");
+	printf("  asm          GB-Z80 assembly language\n");
+	printf("  bgb          BGB-style assembly language\n");
+	printf("  hex          Hexadecimal machine code format\n");
+	printf("  joy          Joypad values\n");
+	printf("  gen1         R/B/Y item codes for use with ACE\n");
+	printf("  gen2         G/S/C item codes for use with ACE\n\n");
+	printf("Examples:\n");
+	printf("  %s EA14D7C9\n", str);
+	printf("  %s -o asm -f bgb_mem.dump\n", str);
+	printf("  %s -ofs 4000 -b pokered.gbc\n", str);
+	printf("  %s -j 0 -b pokered.gbc\n", str);
+	printf("  %s -trace -e 1D2B -b pokered.gbc\n", str);
+	printf("  %s -c -o asm -f zzazz.asm\n", str);
+	printf("  %s -j 0 -batch jobs.txt\n", str);
+	printf("  %s -cache ~/.cache/gbz80aid -o gen1 -f zzazz.asm\n", str);
+	printf("  %s -connect /tmp/gbz80aid.sock -o hex -f zzazz.asm\n", str);
+	printf("  %s -o hex -f zzazz.asm\n", str);
+	printf("  %s -O -o hex -f zzazz.asm\n", str);
+	printf("  %s -relax -o gen1 -f zzazz.asm\n", str);
+	printf("  %s -watch -o gen1 -f zzazz.asm\n", str);
+	printf("  tail -f mem.log | %s -s -o asm -ofs C000\n", str);
+	printf("  %s -run -ofs D322 -mem wram.bin -f zzazz.asm\n", str);
+	printf("  %s -o gen1 0E1626642EBB4140CDD635C9\n", str);
+	printf("  %s -o gen2 -f coin_case.asm\n", str);
+	printf("  %s -o hex,gen1,gen2,joy -f zzazz.asm\n", str);
+	printf("  %s -j 0 -o gen1 -solve -f payload.asm\n", str);
+	exit(0);
+}
 
-	// Placeholder for the last button value
-	char *last;
+// Opens a raw binary file, or stdin for "-"
+FILE* open_binary(char *filename)
+{
+	if (!strcmp(filename, "-"))
+		return stdin;
 
-	printf("\nJoypad Values:\n\n");
+	FILE *file = fopen(filename, "rb");
+	if (!file)
+	{
+		printf("Error : specified file \"%s\" does not exist !\n", filename);
+		exit(1);
+	}
+	return file;
+}
 
-	// Print an initial A to skip the junk byte
-	printf("A\n");
 
-	// Total number of button presses, just for funsies
-	// 3 = The initial A and the ending START + SELECT
-	int presses = 3;
+// Parses a list of registers to run code with ("a=3E,hl=C000,sp=DFFF") into
+// AF, BC, DE, HL and SP. Returns 0 if the list is malformed.
+int parse_registers(unsigned short *registers, char *list)
+{
+	char *pairs[] = {"af", "bc", "de", "hl", "sp"};
+	char *singles = "afbcdehl";
 
-	for (int i = 0; i < len;)
+	for (char *c = list; *c;)
 	{
-		char p14 = str[i++];
-		char p15 = str[i++];
-		char *buttons[12] = {0};
-		int index = 0;
-
-		// Collect all D-Pad values
-		for (int x = 0; x < 4; x++)
-			if (joy_vals[x] <= p14)
-			{
-				buttons[index++] = joy_high[x];
-				p14 -= joy_vals[x];
-				presses++;
-			}
+		unsigned int value;
+		int length = 0;
+		char *equals = strchr(c, '=');
+		if (!equals || sscanf(equals + 1, "%X%n", &value, &length) != 1)
+			return 0;
+
+		int name_length = equals - c;
+		int r = 0;
+		if (name_length == 2)
+		{
+			for (; r < 5 && ((c[0] | 0x20) != pairs[r][0] || (c[1] | 0x20) != pairs[r][1]); r++);
+			if (r == 5 || value > 0xFFFF)
+				return 0;
+			registers[r] = value;
+		}
+		else if (name_length == 1)
+		{
+			for (; singles[r] && (*c | 0x20) != singles[r]; r++);
+			if (!singles[r] || value > 0xFF)
+				return 0;
+			// A, B, D and H are high bytes, and F, C, E and L low ones
+			if (r & 1)
+				registers[r / 2] = (registers[r / 2] & 0xFF00) | value;
+			else
+				registers[r / 2] = (registers[r / 2] & 0xFF) | value << 8;
+		}
+		else
+			return 0;
 
-		// Collect all other values
-		for (int x = 0; x < 4; x++)
-			if (joy_vals[x] <= p15)
-			{
-				buttons[index++] = joy_low[x];
-				p15 -= joy_vals[x];
-				presses++;
-			}
+		c = equals + 1 + length;
+		if (*c == ',')
+			c++;
+		else if (*c)
+			return 0;
+	}
 
-		// Check if 1st button = NEXT code
-		if (buttons[0] == last)
-			// Swap buttons if more than 1 exists
-			if (buttons[1] != 0)
-			{
-				char *tmp = buttons[0];
-				buttons[0] = buttons[1];
-				buttons[1] = tmp;
-			}
-			// Overflow the byte for correction if only 1 exists
-			else
-				if (last == "DOWN")
-				{
-					char *tmp = buttons[0];
-					buttons[0] = "UP";
-					buttons[1] = "DOWN";
-					buttons[2] = "UP";
-					buttons[3] = tmp;
-					index += 3;
-					presses += 3;
-				}
-				else
-				{
-					char *tmp = buttons[0];
-					buttons[0] = "DOWN";
-					buttons[1] = tmp;
-					buttons[2] = "DOWN";
-					presses += 2;
-					index += 2;
-				}
-
-		// Keep track of the last button for correction
-		if (index)
-			last = buttons[index - 1];
-
-		// Print out the button combination for this byte
-		for (int x = 0; x < index; x++)
-			printf("%s ", buttons[x]);
-		printf("%s\n", last);
-		presses++;
-	}
-
-	// Print the EXIT code and number of button presses
-	printf("START + SELECT\n\n");
-	printf("Total number of button presses: %d\n", presses);
+	return 1;
 }
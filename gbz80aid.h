@@ -18,6 +18,67 @@ unsigned char size_table[16][16] = {
 	{1,0,0,0,0,0,1,0,1,0,2,0,0,0,1,0}
 };
 
+// M-cycles taken by each instruction (without its branch, if it has one).
+// Illegal opcodes lock up the CPU and are 0.
+unsigned char cycle_table[16][16] = {
+	{1,3,2,2,1,1,2,1,5,2,2,2,1,1,2,1},
+	{1,3,2,2,1,1,2,1,3,2,2,2,1,1,2,1},
+	{2,3,2,2,1,1,2,1,2,2,2,2,1,1,2,1},
+	{2,3,2,2,3,3,3,1,2,2,2,2,1,1,2,1},
+	{1,1,1,1,1,1,2,1,1,1,1,1,1,1,2,1},
+	{1,1,1,1,1,1,2,1,1,1,1,1,1,1,2,1},
+	{1,1,1,1,1,1,2,1,1,1,1,1,1,1,2,1},
+	{2,2,2,2,2,2,1,2,1,1,1,1,1,1,2,1},
+	{1,1,1,1,1,1,2,1,1,1,1,1,1,1,2,1},
+	{1,1,1,1,1,1,2,1,1,1,1,1,1,1,2,1},
+	{1,1,1,1,1,1,2,1,1,1,1,1,1,1,2,1},
+	{1,1,1,1,1,1,2,1,1,1,1,1,1,1,2,1},
+	{2,3,3,4,3,4,2,4,2,4,3,1,3,6,2,4},
+	{2,3,3,0,3,4,2,4,2,4,3,0,3,0,2,4},
+	{3,3,2,0,0,4,2,4,4,1,4,0,0,0,2,4},
+	{3,3,2,1,0,4,2,4,3,2,4,1,0,0,2,4}
+};
+
+// M-cycles taken by conditional jumps, calls and returns when they branch
+unsigned char branch_cycle_table[16][16] = {
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{3,0,0,0,0,0,0,0,3,0,0,0,0,0,0,0},
+	{3,0,0,0,0,0,0,0,3,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{5,0,4,0,6,0,0,0,5,0,4,0,6,0,0,0},
+	{5,0,4,0,6,0,0,0,5,0,4,0,6,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+	{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}
+};
+
+// M-cycles taken by prefixed instructions (including the prefix)
+unsigned char cb_cycle_table[16][16] = {
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,3,2,2,2,2,2,2,2,3,2},
+	{2,2,2,2,2,2,3,2,2,2,2,2,2,2,3,2},
+	{2,2,2,2,2,2,3,2,2,2,2,2,2,2,3,2},
+	{2,2,2,2,2,2,3,2,2,2,2,2,2,2,3,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2},
+	{2,2,2,2,2,2,4,2,2,2,2,2,2,2,4,2}
+};
+
 // Offsets of data insertion points
 unsigned char offset_table[16][16] = {
 	{0,4,0,0,0,0,3,0,2,0,0,0,0,0,3,0},
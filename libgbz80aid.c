@@ -0,0 +1,5135 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HEX_SIMD
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "libgbz80aid.h"
+#include "gbz80aid.h"
+
+
+int set_error(struct Context*, int, char*, ...);
+void emit(struct Context*, char*, ...);
+void flush_listing(struct Context*);
+void buffer_reserve(struct Buffer*, int);
+void* arena_alloc(struct Arena*, int);
+char* arena_strdup(struct Arena*, char*);
+void arena_reset(struct Arena*);
+void arena_free(struct Arena*);
+int hex_decode_scalar(unsigned char*, const char*, int);
+void hex_encode_scalar(char*, const unsigned char*, int);
+unsigned int hash_string(char*);
+struct Label* find_label(struct Context*, char*);
+int add_label(struct Context*, char*, unsigned int);
+void add_fixup(struct Context*, char*, int, int, unsigned int, int);
+unsigned int hash_instruction(char*, char*);
+void build_encoding_index(void);
+struct Encoding* find_encoding(char*, char*);
+int op2hex(struct Context*, char*, char*, char*);
+void build_templates(void);
+void build_tables(void);
+int format_instruction(struct Buffer*, unsigned char*, int, int, unsigned int);
+int print_instruction(struct Context*, unsigned char*, int, int);
+void* disassembly_worker(void*);
+void format_data(struct Buffer*, unsigned char*, int, int, unsigned int);
+
+
+// Struct for holding reverse lookup entries (mnemonic + params -> opcode)
+struct Encoding {
+	char *opcode;
+	char *param;
+	unsigned char index;
+	unsigned char cb;
+};
+
+// Struct for holding a precomputed listing line tail per opcode
+struct Template {
+	char text[24];
+	unsigned char length;
+	unsigned char arg_size;
+	unsigned char arg_pos;
+};
+
+// Struct for holding one chunk of a parallel disassembly
+struct Chunk {
+	int start;
+	int end;
+	struct Buffer text;
+	int *starts;
+	int *lines;
+	int count;
+	int capacity;
+	char done;
+};
+
+// Struct for holding the shared state of a parallel disassembly
+struct Disassembly {
+	unsigned char *bytes;
+	int len;
+	int bgb;
+	int offset;
+	int chunk_size;
+	int thread_count;
+	struct Chunk *chunks;
+	int chunk_count;
+	int next_chunk;
+	int merged;
+	pthread_mutex_t lock;
+	pthread_cond_t chunk_done;
+	pthread_cond_t chunk_merged;
+};
+
+// Struct for holding error detections, and the items seen so far
+struct Error {
+	unsigned char key_quantity;
+	unsigned char duplicates;
+	unsigned char glitches;
+	unsigned char seen_items[16][16];
+};
+
+// Struct for holding a line of assembly as the lexer reads it
+struct Lexed {
+	// Where its text starts and ends (at a comment or line break), and
+	// whether it defines a label
+	char *start;
+	char *end;
+	char label;
+
+	// Mnemonic, cut short if the word is longer, and whether it's a jump
+	// written with '!'
+	char mnemonic[8];
+	int mnemonic_length;
+	char fixed;
+
+	// Operands with the number swapped for a placeholder, its digits, and
+	// where a jump's label starts in the text (or NULL)
+	char operands[256];
+	char digits[5];
+	char *target;
+};
+
+
+// Smallest block an arena allocates
+#define ARENA_BLOCK_SIZE 65536
+
+// Longest instruction (opcode + 2 argument bytes)
+#define MAX_INSTRUCTION_SIZE 3
+
+// Raw binary input is disassembled in chunks of this size
+#define STREAM_CHUNK_SIZE 65536
+
+// Disassembly is written to stdout in blocks of roughly this size
+#define LISTING_BLOCK_SIZE 65536
+
+// Registers and flags tracked by the optimizer
+#define REG_A 0x001
+#define REG_B 0x002
+#define REG_C 0x004
+#define REG_D 0x008
+#define REG_E 0x010
+#define REG_H 0x020
+#define REG_L 0x040
+#define REG_SP 0x080
+#define REG_FZ 0x100
+#define REG_FN 0x200
+#define REG_FH 0x400
+#define REG_FC 0x800
+#define REG_FLAGS (REG_FZ | REG_FN | REG_FH | REG_FC)
+#define REG_ALL 0xFFF
+
+// Struct for holding one instruction being optimized
+struct Optimized {
+	unsigned char bytes[MAX_INSTRUCTION_SIZE];
+	int size;
+	int start;
+	int fixup;
+	int target;
+	char jump;
+	char entry;
+	char pinned;
+	char removed;
+	unsigned int use;
+	unsigned int def;
+	unsigned int in;
+	unsigned int live;
+};
+
+// M-cycles in a frame (154 lines of 114), and a path that can't be taken
+#define FRAME_CYCLES 17556
+#define PATH_UNREACHABLE 0x3FFFFFFF
+
+// Struct for holding one basic block of a timing profile, with what it takes
+// to fall through to the next block or to branch out of it (-1 if it can't),
+// and where to (-1 for leaving the code)
+struct Block {
+	int start;
+	int fall;
+	int fall_cost;
+	int jump;
+	int jump_cost;
+};
+
+// Flags in F
+#define FLAG_Z 0x80
+#define FLAG_N 0x40
+#define FLAG_H 0x20
+#define FLAG_C 0x10
+
+// Joypad buttons (D-pad first, as in joy_high and joy_low), and the
+// states of a byte being entered: its value so far and the last press
+#define JOY_BUTTONS 8
+#define JOY_STATES (256 * JOY_BUTTONS)
+#define JOY_START 0xFFFF
+#define JOY_UNREACHABLE 0x3FFFFFFF
+
+// Struct for holding the cheapest presses from each previous button (or
+// none) to each state, and the state each one comes from
+struct JoyWalks {
+	int dist[JOY_BUTTONS + 1][JOY_STATES];
+	unsigned short prev[JOY_BUTTONS + 1][JOY_STATES];
+};
+
+// Most bytes a streamed joypad plan holds back while its cheapest ways to
+// enter them still disagree
+#define JOY_WINDOW 4096
+
+// Struct for holding a joypad plan as it's streamed: the bytes whose buttons
+// aren't decided yet (a ring of JOY_WINDOW), the cheapest cost for each
+// button the last one can end on, and the button each byte's cheapest way
+// in comes from
+struct JoyStream {
+	struct JoyWalks *walks;
+	int cost[JOY_BUTTONS + 1];
+	unsigned char from[JOY_WINDOW][JOY_BUTTONS];
+	unsigned char bytes[JOY_WINDOW];
+	int first;
+	int count;
+	int last;
+	int presses;
+	int total;
+};
+
+// Limits of the item solver. A bag holds at most MAX_SOLVE_SLOTS stacks,
+// and the search gives up after MAX_SOLVE_COST changes.
+#define MAX_SOLVE_SLOTS 64
+#define MAX_SOLVE_BYTES (MAX_SOLVE_SLOTS * 2)
+#define MAX_SOLVE_NODES MAX_SOLVE_BYTES
+#define MAX_SOLVE_LABELS 64
+#define MAX_SOLVE_PENDING 32
+#define MAX_SOLVE_COST 8
+#define SOLVE_NONE 0x7FFFFFFF
+
+// Failed partial programs the search remembers, shared by every worker.
+// Each entry packs the top of the hash with whether the failure was
+// because of the budget (bit 4) and how much budget was left (bits 0-3).
+#define SOLVE_MEMO_SIZE (1 << 20)
+#define SOLVE_MEMO_USED 0x80
+#define SOLVE_MEMO_LIMITED 0x10
+
+// Filler options before each instruction: none, 8 single bytes, 64 pairs
+// of them, and jr $00
+#define FILLER_OPTIONS 74
+
+// Struct for holding one encoding of an instruction for the item solver.
+// ref is 1 for an absolute label reference and 2 for a relative one.
+struct Choice {
+	unsigned char bytes[MAX_INSTRUCTION_SIZE];
+	int size;
+	char ref;
+	char *text;
+};
+
+// Struct for holding one instruction (or merged pair) of a solved program
+struct SolveNode {
+	struct Choice choices[2];
+	int choice_count;
+	int target;
+	char *source;
+	char *before;
+};
+
+// Struct for holding a label of a solved program. Labels outside of the
+// program have no node (-1) and a fixed address instead.
+struct SolveLabel {
+	char *name;
+	int node;
+	unsigned int address;
+};
+
+// Struct for holding a label reference that comes before its label
+struct Pending {
+	int from;
+	int label;
+	char relative;
+};
+
+// Struct for holding one partial program during the search
+struct SolveState {
+	unsigned char bytes[MAX_SOLVE_BYTES];
+	unsigned char known[MAX_SOLVE_BYTES];
+	unsigned long long seen[4];
+	int label_pos[MAX_SOLVE_LABELS];
+	struct Pending pending[MAX_SOLVE_PENDING];
+	int pending_count;
+	unsigned char filler[MAX_SOLVE_NODES];
+	unsigned char choice[MAX_SOLVE_NODES];
+	int pos;
+	int cost;
+};
+
+// Struct for holding the shared state of the item solver
+struct Solver {
+	struct SolveNode nodes[MAX_SOLVE_NODES];
+	int node_count;
+	struct SolveLabel labels[MAX_SOLVE_LABELS];
+	int label_count;
+	char *after;
+	int min_rest[MAX_SOLVE_NODES + 1];
+	int gen;
+	int slots;
+	unsigned int offset;
+	int budget;
+	char budget_hit;
+	struct SolveState start;
+	struct SolveState solution;
+	unsigned long long *memo;
+	int split;
+	int task_count;
+	int best_task;
+	int next_task;
+	pthread_mutex_t lock;
+};
+
+
+void instruction_effects(unsigned char*, unsigned int*, unsigned int*);
+void compute_liveness(struct Optimized*, int);
+void optimize_code(struct Context*);
+void pin_code(struct Context*, char*);
+void relax_jumps(struct Context*);
+int instruction_cycles(unsigned char*, int, int*);
+void plan_joy_walks(struct Context*, struct JoyWalks*);
+int joy_value(int);
+char* joy_name(int);
+void joy_step(struct Context*, struct JoyWalks*, int*, unsigned char, unsigned char*);
+int joy_cheapest(int*);
+void print_joy_byte(struct Context*, struct JoyWalks*, int, unsigned char, int, int*, int*);
+void print_joy_total(struct Context*, int, int);
+void joy_stream_byte(struct Context*, struct JoyStream*, unsigned char);
+void joy_stream_decide(struct Context*, struct JoyStream*, int, int);
+void print_item(struct Context*, unsigned char*, int, int, struct Error*);
+void print_item_warnings(struct Context*, struct Error*);
+int patch_fixup(struct Context*, struct Fixup*, struct Label*);
+int stream_fixups(struct Context*, int);
+int read_available(FILE*, char*, int);
+int lex_line(char*, struct Lexed*);
+char lex_number(struct Lexed*, int*, char);
+char* lex_name(struct Arena*, char*, char*, char);
+void free_solver(struct Solver*);
+int label_at(struct Solver*, int);
+int add_choices(struct Context*, struct Solver*);
+char* ref_text(unsigned char, char*);
+int label_address(struct Solver*, struct SolveState*, int);
+int check_byte(struct Solver*, struct SolveState*, int);
+int resolve_byte(struct Solver*, struct SolveState*, int, unsigned char);
+int resolve_ref(struct Solver*, struct SolveState*, int, int, int);
+int append_choice(struct Solver*, struct SolveState*, struct Choice*, int);
+int place_labels(struct Solver*, struct SolveState*, int);
+int filler_bytes(int, unsigned char*);
+unsigned long long solve_hash(struct Solver*, struct SolveState*, int);
+int solve_node(struct Solver*, struct SolveState*, int, int);
+void* solve_worker(void*);
+int solve(struct Context*, struct Solver*, int);
+int emit_instructions(struct Context*, unsigned char*, int, char*, int);
+int instruction_text(char*, unsigned char*, int);
+void machine_write(struct Machine*, unsigned short, unsigned char);
+unsigned char machine_get(struct Machine*, int);
+void machine_set(struct Machine*, int, unsigned char);
+unsigned short machine_pair(struct Machine*, int);
+void machine_set_pair(struct Machine*, int, unsigned short);
+void machine_push(struct Machine*, unsigned short);
+unsigned short machine_pop(struct Machine*);
+int machine_condition(struct Machine*, int);
+void machine_alu(struct Machine*, int, unsigned char);
+unsigned char machine_shift(struct Machine*, int, unsigned char);
+void watch_assemble(struct Watch*, int, char*, int, int);
+void watch_resolve(struct Context*, struct Watch*, int);
+int watch_line_at(struct Watch*, int);
+int watch_error(struct Context*, struct Watch*);
+
+
+// Listing templates for regular, BGB-style and CB-prefixed opcodes
+struct Template templates[3][256];
+
+// Reverse encoding index, built once from the opcode/param tables.
+// 3 tables * 256 cells fit comfortably under a 0.5 load factor.
+#define ENCODING_INDEX_SIZE 2048
+struct Encoding encoding_index[ENCODING_INDEX_SIZE];
+
+// Value of each hex digit character, 0xFF for everything else
+const unsigned char hex_values[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// The lookup tables above are built exactly once, by whichever thread gets
+// there first, and are read-only from then on
+pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+// Instructions that do nothing, used as filler by the item solver
+// (nop and ld r,r)
+const unsigned char solve_fillers[8] = {0x00, 0x40, 0x49, 0x52, 0x5B, 0x64, 0x6D, 0x7F};
+
+
+// Sets up a context with the default options, writing to stdout
+void context_init(struct Context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->show_warnings = 1;
+	ctx->thread_count = 1;
+	ctx->chunk_size = 0x4000;
+	ctx->slots = 20;
+	for (int b = 0; b < 8; b++)
+		ctx->joy_costs[b] = 1;
+
+	// Registers as the boot ROM leaves them on a DMG, and a second to run
+	ctx->registers[0] = 0x01B0;
+	ctx->registers[1] = 0x0013;
+	ctx->registers[2] = 0x00D8;
+	ctx->registers[3] = 0x014D;
+	ctx->registers[4] = 0xFFFE;
+	ctx->run_limit = FRAME_CYCLES * 60L;
+	ctx->write = file_sink;
+	ctx->user = stdout;
+	ctx->line_num = 1;
+}
+
+
+// Frees everything a context has allocated
+void context_free(struct Context *ctx)
+{
+	arena_free(&ctx->names);
+	arena_free(&ctx->scratch);
+	free(ctx->labels);
+	free(ctx->fixups);
+	free(ctx->machine_code.data);
+	free(ctx->listing.data);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+
+// Output sink writing to a FILE*
+void file_sink(void *user, const char *data, int len)
+{
+	fwrite(data, 1, len, user);
+}
+
+
+// Output sink collecting everything in a struct Buffer
+void buffer_sink(void *user, const char *data, int len)
+{
+	buffer_append(user, (unsigned char*)data, len);
+}
+
+
+// Records an error message and returns its code
+int set_error(struct Context *ctx, int code, char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vsnprintf(ctx->error, sizeof(ctx->error), format, args);
+	va_end(args);
+	return code;
+}
+
+
+// Appends formatted text to the context's output
+void emit(struct Context *ctx, char *format, ...)
+{
+	char text[256];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	buffer_append(&ctx->listing, (unsigned char*)text, (len < (int)sizeof(text) ? len : (int)sizeof(text) - 1));
+}
+
+
+// Sends the buffered output to the sink in one go
+void flush_listing(struct Context *ctx)
+{
+	if (ctx->listing.size)
+		ctx->write(ctx->user, (char*)ctx->listing.data, ctx->listing.size);
+	ctx->listing.size = 0;
+}
+
+
+// Builds every shared lookup table
+void build_tables(void)
+{
+	build_encoding_index();
+	build_templates();
+}
+
+
+// Builds the lookup tables ahead of the first conversion that needs them
+void init_tables(void)
+{
+	pthread_once(&tables_once, build_tables);
+}
+
+
+// Assembles a source file line by line. Regular files are memory-mapped and
+// assembled in place; anything that can't be mapped is read through a buffer.
+int assemble_file(struct Context *ctx, char *filename)
+{
+	if (!strcmp(filename, "-"))
+		return assemble_stream(ctx, stdin);
+
+#ifndef _WIN32
+	int fd = open(filename, O_RDONLY);
+	struct stat info;
+
+	if (fd >= 0 && !fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0)
+	{
+		// A private writable mapping lets each line be terminated in place
+		// without touching the file itself
+		size_t size = info.st_size;
+		char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (data != MAP_FAILED)
+		{
+			char *line = data;
+			char *end = data + size;
+			int result = GB_OK;
+
+			while (line < end && !result)
+			{
+				char *newline = memchr(line, '\n', end - line);
+				if (newline)
+				{
+					*newline = 0;
+					result = asm_to_hex(ctx, line);
+					line = newline + 1;
+					continue;
+				}
+
+				// The last line has no newline. The rest of the final page
+				// is zero-filled, unless the file ends exactly on a page.
+				if (size % sysconf(_SC_PAGESIZE))
+					result = asm_to_hex(ctx, line);
+				else
+				{
+					char *copy = malloc(end - line + 1);
+					memcpy(copy, line, end - line);
+					copy[end - line] = 0;
+					result = asm_to_hex(ctx, copy);
+					free(copy);
+				}
+				break;
+			}
+
+			munmap(data, size);
+			return result;
+		}
+	}
+	else if (fd >= 0)
+		close(fd);
+#endif
+
+	FILE* file = fopen(filename, "r");
+
+	if(!file)
+		return set_error(ctx, GB_ERROR_FILE, "Error : specified file \"%s\" does not exist !", filename);
+
+	int result = assemble_stream(ctx, file);
+	fclose(file);
+	return result;
+}
+
+
+// Assembles source held in memory, one line at a time. Lines are terminated
+// in place.
+int assemble_source(struct Context *ctx, char *source)
+{
+	int result = GB_OK;
+
+	for (char *line = source; line && !result;)
+	{
+		char *newline = strchr(line, '\n');
+		if (newline)
+			*newline++ = 0;
+		result = asm_to_hex(ctx, line);
+		line = newline;
+	}
+
+	return result;
+}
+
+
+// Assembles source read from a stream (stdin, pipes and other unmappable
+// files). The buffer grows to fit the longest line, so lines are never split.
+int assemble_stream(struct Context *ctx, FILE *file)
+{
+	int capacity = 65536;
+	int size = 0;
+	int result = GB_OK;
+	char *buffer = malloc(capacity + 1);
+
+	for (;;)
+	{
+		int read = fread(buffer + size, 1, capacity - size, file);
+		size += read;
+		buffer[size] = 0;
+
+		// Assemble every complete line in the buffer
+		char *line = buffer;
+		char *newline;
+		while (!result && (newline = memchr(line, '\n', buffer + size - line)))
+		{
+			*newline = 0;
+			result = asm_to_hex(ctx, line);
+			line = newline + 1;
+		}
+
+		// Move the partial line to the front for the next read
+		size -= line - buffer;
+		memmove(buffer, line, size);
+
+		if (!read || result)
+			break;
+
+		// The partial line fills the buffer, so it needs more room
+		if (size == capacity)
+		{
+			capacity *= 2;
+			buffer = realloc(buffer, capacity + 1);
+		}
+	}
+
+	// Last line without a newline
+	if (size && !result)
+	{
+		buffer[size] = 0;
+		result = asm_to_hex(ctx, buffer);
+	}
+
+	free(buffer);
+	return result;
+}
+
+
+// Reads a line of assembly in a single pass without modifying it. The
+// mnemonic and operands come out lowercased and without spaces, the first
+// bracket pair becomes parentheses, a jump to a label gets a placeholder
+// address, and the first number becomes $xx or $xxyy with its digits put
+// aside in little-endian order. Returns nonzero if a bracket isn't closed.
+int lex_line(char *str, struct Lexed *line)
+{
+	char *c = str;
+	int n = 0;
+	int out = 0;
+
+	// How far into the number the lexer is, and where the first brackets went
+	int number = -1;
+	int opening = -1;
+	int closing = -1;
+
+	// Where a jump's target starts in the line and in the operands while it
+	// could still be a label, and how far into the number the lexer was then
+	char *target = NULL;
+	int target_start = 0;
+	int target_number = -1;
+	char target_digits[sizeof(line->digits)];
+	char jump, target_next, comma = 0;
+
+	memset(line->mnemonic, 0, sizeof(line->mnemonic));
+	memset(line->digits, 0, sizeof(line->digits));
+	line->target = NULL;
+	line->fixed = 0;
+
+	// Leading spaces
+	for (; *c == ' ' || *c == '\t'; c++);
+	line->start = c;
+	line->label = (*c == '.');
+
+	// The mnemonic runs up to a space (or anything below one), and is cut
+	// short if it's too long to be one
+	for (; *c > 0x20 && *c != ';'; c++, n++)
+	{
+		line->label |= (*c == ':');
+		if (n < (int)sizeof(line->mnemonic) - 1)
+			line->mnemonic[n] = (*c > 0x40 && *c < 0x5B ? *c + 0x20 : *c);
+	}
+	line->mnemonic_length = n;
+
+	// A jump ending in '!' keeps the size it was written with
+	if (line->mnemonic[0] == 'j' && line->mnemonic[2] == '!')
+	{
+		line->mnemonic[2] = 0;
+		line->fixed = 1;
+	}
+
+	// Jump targets follow the condition, if there is one
+	jump = (!strcmp(line->mnemonic, "jp") || !strcmp(line->mnemonic, "jr") || !strcmp(line->mnemonic, "call"));
+	target_next = jump;
+
+	for (; *c && *c != ';' && *c != '\n' && *c != '\r'; c++)
+	{
+		char ch = *c;
+		if (ch == ' ' || ch == '\t')
+			continue;
+		if (ch > 0x40 && ch < 0x5B)
+			ch += 0x20;
+		line->label |= (ch == ':');
+
+		// Addresses and registers aren't labels
+		if (target_next)
+		{
+			target_next = 0;
+			if (ch != '$' && ch != '(')
+			{
+				target = c;
+				target_start = out;
+				target_number = number;
+				memcpy(target_digits, line->digits, sizeof(target_digits));
+			}
+		}
+		if (jump && ch == ',' && !comma)
+		{
+			comma = 1;
+			target_next = 1;
+			target = NULL;
+		}
+
+		ch = lex_number(line, &number, ch);
+		if (ch == '[' && opening < 0)
+			opening = out;
+		if (ch == ']' && closing < 0)
+			closing = out;
+
+		// Anything past the longest operands an error can show is dropped
+		if (out < (int)sizeof(line->operands) - 1)
+			line->operands[out] = ch;
+		out++;
+	}
+	line->end = c;
+	if (out > (int)sizeof(line->operands) - 1)
+		out = sizeof(line->operands) - 1;
+
+	// A jump target that isn't "hl" is a label, which may not be defined
+	// yet, so it gets a placeholder address for now
+	if (target && (out - target_start != 2 || memcmp(line->operands + target_start, "hl", 2)))
+	{
+		line->target = target;
+		out = target_start;
+		if (opening >= out)
+			opening = -1;
+		if (closing >= out)
+			closing = -1;
+
+		// The placeholder is read as if it had been written instead
+		number = target_number;
+		memcpy(line->digits, target_digits, sizeof(target_digits));
+		for (char *address = (line->mnemonic[1] == 'r' ? "$00" : "$0000"); *address && out < (int)sizeof(line->operands) - 1; address++)
+			line->operands[out++] = lex_number(line, &number, *address);
+	}
+	line->operands[out] = 0;
+
+	// Some syntaxes use '[' instead of '('. Only the first pair is looked at,
+	// since no instruction uses parentheses twice.
+	if (opening >= 0 && opening < out)
+	{
+		line->operands[opening] = '(';
+		if (closing < 0 || closing >= out)
+			return 1;
+		line->operands[closing] = ')';
+	}
+
+	return 0;
+}
+
+
+// Swaps the digits of the first number on a line for placeholders as the
+// lexer reads them, putting them aside. The number is how many characters of
+// it have been read (-1 before its '$', 5 once it's done), and its third
+// character decides whether it has four digits.
+char lex_number(struct Lexed *line, int *number, char ch)
+{
+	if (*number < 0 || *number == 5)
+	{
+		if (ch == '$' && *number < 0)
+			*number = 0;
+		return ch;
+	}
+
+	if (*number < 2)
+	{
+		line->digits[(*number)++] = ch;
+		return 'x';
+	}
+	if (*number == 2 && ch > ')')
+	{
+		line->digits[2] = line->digits[0];
+		line->digits[3] = line->digits[1];
+		line->digits[0] = ch;
+		*number = 3;
+		return 'y';
+	}
+	if (*number == 3)
+	{
+		line->digits[1] = ch;
+		*number = 5;
+		return 'y';
+	}
+
+	*number = 5;
+	return ch;
+}
+
+
+// Copies a name out of a line, lowercased and without spaces, up to the end
+// or the stop character. The copy lives as long as the arena.
+char* lex_name(struct Arena *arena, char *start, char *end, char stop)
+{
+	char *name = arena_alloc(arena, end - start + 1);
+	int n = 0;
+
+	for (char *c = start; c < end && *c != stop; c++)
+		if (*c != ' ' && *c != '\t')
+			name[n++] = (*c > 0x40 && *c < 0x5B ? *c + 0x20 : *c);
+	name[n] = 0;
+	return name;
+}
+
+
+// Makes room for len more bytes in a buffer, doubling its capacity whenever
+// it runs out
+void buffer_reserve(struct Buffer *buf, int len)
+{
+	if (buf->size + len > buf->capacity)
+	{
+		int capacity = (buf->capacity ? buf->capacity : 64);
+		while (capacity < buf->size + len)
+			capacity *= 2;
+		buf->data = realloc(buf->data, capacity);
+		buf->capacity = capacity;
+	}
+}
+
+
+// Allocates len bytes from an arena. They're only released along with the
+// rest of the arena.
+void* arena_alloc(struct Arena *arena, int len)
+{
+	// Keep every allocation aligned for any type
+	len = (len + 7) & ~7;
+
+	if (!arena->block || arena->used + len > arena->block->size)
+	{
+		int size = (len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE);
+		struct ArenaBlock *block = malloc(sizeof(struct ArenaBlock) + size);
+		block->next = arena->block;
+		block->size = size;
+		arena->block = block;
+		arena->used = 0;
+	}
+
+	void *data = arena->block->data + arena->used;
+	arena->used += len;
+	return data;
+}
+
+
+// Copies a string into an arena
+char* arena_strdup(struct Arena *arena, char *str)
+{
+	int len = strlen(str) + 1;
+	return memcpy(arena_alloc(arena, len), str, len);
+}
+
+
+// Releases everything allocated from an arena, keeping its last block to
+// allocate from again (which is all it has unless something outgrew it)
+void arena_reset(struct Arena *arena)
+{
+	if (!arena->block)
+		return;
+
+	struct ArenaBlock *rest = arena->block->next;
+	arena->block->next = NULL;
+	arena->used = 0;
+	while (rest)
+	{
+		struct ArenaBlock *next = rest->next;
+		free(rest);
+		rest = next;
+	}
+}
+
+
+// Frees all of an arena's blocks
+void arena_free(struct Arena *arena)
+{
+	arena_reset(arena);
+	free(arena->block);
+	arena->block = NULL;
+}
+
+
+// Appends bytes to a buffer
+void buffer_append(struct Buffer *buf, unsigned char *bytes, int len)
+{
+	buffer_reserve(buf, len);
+	memcpy(buf->data + buf->size, bytes, len);
+	buf->size += len;
+}
+
+
+// Decodes hex digits two at a time. Returns the offset of the first
+// character that isn't a hex digit, or -1 if there's none.
+int hex_decode_scalar(unsigned char *out, const char *hex, int len)
+{
+	for (int i = 0; i + 1 < len; i += 2)
+	{
+		unsigned char high = hex_values[(unsigned char)hex[i]];
+		unsigned char low = hex_values[(unsigned char)hex[i + 1]];
+		if ((high | low) > 0xF)
+			return i + (high < 0x10);
+		out[i / 2] = high << 4 | low;
+	}
+	return -1;
+}
+
+
+// Encodes bytes as uppercase hex digits
+void hex_encode_scalar(char *out, const unsigned char *bytes, int len)
+{
+	static const char digits[] = "0123456789ABCDEF";
+
+	for (int i = 0; i < len; i++)
+	{
+		out[i * 2] = digits[bytes[i] >> 4];
+		out[i * 2 + 1] = digits[bytes[i] & 0xF];
+	}
+}
+
+
+#ifdef HEX_SIMD
+// SSE2 and AVX2 versions of the kernels above. Each vector of characters is
+// classified as digits and letters in the same pass that converts it, and the
+// first invalid one is found from the validity mask.
+
+// Values of the hex digits in each byte of v, and a mask of which ones were
+// valid digits at all
+__attribute__((target("sse2")))
+__m128i hex_values_sse2(__m128i v, __m128i *valid)
+{
+	__m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digit, _mm_set1_epi8(-1)), _mm_cmplt_epi8(digit, _mm_set1_epi8(10)));
+	__m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(letter, _mm_set1_epi8(-1)), _mm_cmplt_epi8(letter, _mm_set1_epi8(6)));
+
+	*valid = _mm_or_si128(is_digit, is_letter);
+	return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+__m256i hex_values_avx2(__m256i v, __m256i *valid)
+{
+	__m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+	__m256i letter = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(digit, _mm256_set1_epi8(-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(10), digit));
+	__m256i is_letter = _mm256_and_si256(_mm256_cmpgt_epi8(letter, _mm256_set1_epi8(-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(6), letter));
+
+	*valid = _mm256_or_si256(is_digit, is_letter);
+	return _mm256_or_si256(_mm256_and_si256(is_digit, digit), _mm256_and_si256(is_letter, _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+}
+
+// ASCII for the nybbles in each byte of n
+__attribute__((target("sse2")))
+__m128i hex_digits_sse2(__m128i n)
+{
+	__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('A' - '0' - 10));
+	return _mm_add_epi8(n, _mm_add_epi8(_mm_set1_epi8('0'), letters));
+}
+
+__attribute__((target("avx2")))
+__m256i hex_digits_avx2(__m256i n)
+{
+	__m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8('A' - '0' - 10));
+	return _mm256_add_epi8(n, _mm256_add_epi8(_mm256_set1_epi8('0'), letters));
+}
+
+__attribute__((target("sse2")))
+int hex_decode_sse2(unsigned char *out, const char *hex, int len)
+{
+	int i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i valid;
+		__m128i values = hex_values_sse2(_mm_loadu_si128((__m128i*)(hex + i)), &valid);
+
+		int mask = _mm_movemask_epi8(valid);
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+
+		// Each 16-bit lane holds a high nybble and the low nybble after it
+		__m128i high = _mm_and_si128(values, _mm_set1_epi16(0xFF));
+		__m128i low = _mm_srli_epi16(values, 8);
+		__m128i bytes = _mm_or_si128(_mm_slli_epi16(high, 4), low);
+		_mm_storel_epi64((__m128i*)(out + i / 2), _mm_packus_epi16(bytes, bytes));
+	}
+
+	int bad = hex_decode_scalar(out + i / 2, hex + i, len - i);
+	return (bad < 0 ? bad : i + bad);
+}
+
+__attribute__((target("avx2")))
+int hex_decode_avx2(unsigned char *out, const char *hex, int len)
+{
+	int i = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i valid;
+		__m256i values = hex_values_avx2(_mm256_loadu_si256((__m256i*)(hex + i)), &valid);
+
+		unsigned int mask = _mm256_movemask_epi8(valid);
+		if (mask != 0xFFFFFFFF)
+			return i + __builtin_ctz(~mask);
+
+		__m256i high = _mm256_and_si256(values, _mm256_set1_epi16(0xFF));
+		__m256i low = _mm256_srli_epi16(values, 8);
+		__m256i bytes = _mm256_or_si256(_mm256_slli_epi16(high, 4), low);
+
+		// Packing works within each 128-bit lane, so gather the two halves
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0x08);
+		_mm_storeu_si128((__m128i*)(out + i / 2), _mm256_castsi256_si128(packed));
+	}
+
+	int bad = hex_decode_sse2(out + i / 2, hex + i, len - i);
+	return (bad < 0 ? bad : i + bad);
+}
+
+__attribute__((target("sse2")))
+void hex_encode_sse2(char *out, const unsigned char *bytes, int len)
+{
+	int i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i*)(bytes + i));
+		__m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0xF));
+		__m128i low = _mm_and_si128(v, _mm_set1_epi8(0xF));
+
+		_mm_storeu_si128((__m128i*)(out + i * 2), hex_digits_sse2(_mm_unpacklo_epi8(high, low)));
+		_mm_storeu_si128((__m128i*)(out + i * 2 + 16), hex_digits_sse2(_mm_unpackhi_epi8(high, low)));
+	}
+
+	hex_encode_scalar(out + i * 2, bytes + i, len - i);
+}
+
+__attribute__((target("avx2")))
+void hex_encode_avx2(char *out, const unsigned char *bytes, int len)
+{
+	int i = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((__m256i*)(bytes + i));
+		__m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0xF));
+		__m256i low = _mm256_and_si256(v, _mm256_set1_epi8(0xF));
+
+		// Interleaving also works within each 128-bit lane
+		__m256i first = _mm256_unpacklo_epi8(high, low);
+		__m256i second = _mm256_unpackhi_epi8(high, low);
+		_mm256_storeu_si256((__m256i*)(out + i * 2), hex_digits_avx2(_mm256_permute2x128_si256(first, second, 0x20)));
+		_mm256_storeu_si256((__m256i*)(out + i * 2 + 32), hex_digits_avx2(_mm256_permute2x128_si256(first, second, 0x31)));
+	}
+
+	hex_encode_sse2(out + i * 2, bytes + i, len - i);
+}
+#endif
+
+
+// Decodes hex digits into bytes, using the widest vectors the CPU has. An odd
+// digit at the end becomes the high nybble of the last byte. Returns the
+// offset of the first character that isn't a hex digit, or -1 if there's none.
+int hex_decode(unsigned char *out, const char *hex, int len)
+{
+	int bad;
+
+#ifdef HEX_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		bad = hex_decode_avx2(out, hex, len & ~1);
+	else if (__builtin_cpu_supports("sse2"))
+		bad = hex_decode_sse2(out, hex, len & ~1);
+	else
+#endif
+		bad = hex_decode_scalar(out, hex, len & ~1);
+
+	if (bad < 0 && len & 1)
+	{
+		if (hex_values[(unsigned char)hex[len - 1]] > 0xF)
+			return len - 1;
+		out[len / 2] = hex_values[(unsigned char)hex[len - 1]] << 4;
+	}
+	return bad;
+}
+
+
+// Encodes bytes as uppercase hex digits, using the widest vectors the CPU has
+void hex_encode(char *out, const unsigned char *bytes, int len)
+{
+#ifdef HEX_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		hex_encode_avx2(out, bytes, len);
+	else if (__builtin_cpu_supports("sse2"))
+		hex_encode_sse2(out, bytes, len);
+	else
+#endif
+		hex_encode_scalar(out, bytes, len);
+}
+
+
+// Reads a hex string into raw bytes, ignoring spaces, tabs and line breaks.
+// A trailing odd nybble becomes the high nybble of the last byte.
+int parse_hex(struct Context *ctx, char *str, struct Buffer *buf)
+{
+	int len = strlen(str);
+	char *digits = str;
+
+	// Whitespace is rare in big dumps, so it only costs a copy when it's there
+	if (strpbrk(str, " \t\r\n"))
+	{
+		digits = malloc(len + 1);
+		len = 0;
+		for (char *c = str; *c; c++)
+			if (*c != ' ' && *c != '\t' && *c != '\r' && *c != '\n')
+				digits[len++] = *c;
+	}
+
+	buffer_reserve(buf, (len + 1) / 2);
+	int bad = hex_decode(buf->data + buf->size, digits, len);
+
+	if (digits != str)
+		free(digits);
+
+	if (bad >= 0)
+	{
+		// Find the offset in the original string
+		int offset = 0;
+		for (int count = 0; count < bad || str[offset] == ' ' || str[offset] == '\t' || str[offset] == '\r' || str[offset] == '\n'; offset++)
+			if (str[offset] != ' ' && str[offset] != '\t' && str[offset] != '\r' && str[offset] != '\n')
+				count++;
+		return set_error(ctx, GB_ERROR_PARSE, "Couldn't parse hex digit [%c] at offset %d", str[offset], offset);
+	}
+
+	buf->size += (len + 1) / 2;
+	return GB_OK;
+}
+
+
+// Reads all of a raw binary file into a buffer
+void read_binary(FILE *file, struct Buffer *buf)
+{
+	unsigned char chunk[STREAM_CHUNK_SIZE];
+	int read;
+
+	while ((read = fread(chunk, 1, sizeof(chunk), file)))
+		buffer_append(buf, chunk, read);
+}
+
+
+// Renders machine code as uppercase hex and prints it
+void print_hex(struct Context *ctx, unsigned char *bytes, int len)
+{
+	buffer_append(&ctx->listing, (unsigned char*)"\nMachine code: ", 15);
+	buffer_reserve(&ctx->listing, len * 2);
+	hex_encode((char*)ctx->listing.data + ctx->listing.size, bytes, len);
+	ctx->listing.size += len * 2;
+	buffer_append(&ctx->listing, (unsigned char*)"\n", 1);
+	flush_listing(ctx);
+}
+
+
+// FNV-1a hash of an opcode/param pair
+unsigned int hash_instruction(char *opcode, char *param)
+{
+	unsigned int hash = 2166136261u;
+	for (; *opcode; opcode++)
+		hash = (hash ^ (unsigned char)*opcode) * 16777619u;
+	// Separator so "rl"+"ca" and "rlc"+"a" don't collide
+	hash = (hash ^ ' ') * 16777619u;
+	for (; *param; param++)
+		hash = (hash ^ (unsigned char)*param) * 16777619u;
+	return hash;
+}
+
+
+// Fills the reverse encoding index from the opcode/param lookup tables.
+// Cells are visited in the same order as the old linear scan (CB, BGB, then
+// regular table for each opcode), and the first entry for a key wins.
+void build_encoding_index(void)
+{
+	for (int i = 0; i < 16; i++)
+		for (int k = 0; k < 16; k++)
+		{
+			char *opcodes[3] = {cb_opcode_table[i][k], bgb_opcode_table[i][k], opcode_table[i][k]};
+			char *params[3] = {cb_param_table[i][k], bgb_param_table[i][k], param_table[i][k]};
+
+			for (int t = 0; t < 3; t++)
+			{
+				unsigned int slot = hash_instruction(opcodes[t], params[t]) & (ENCODING_INDEX_SIZE - 1);
+
+				// Linear probing until a free slot or the same key turns up
+				while (encoding_index[slot].opcode &&
+					   (strcmp(encoding_index[slot].opcode, opcodes[t]) ||
+						strcmp(encoding_index[slot].param, params[t])))
+					slot = (slot + 1) & (ENCODING_INDEX_SIZE - 1);
+
+				if (encoding_index[slot].opcode)
+					continue;
+
+				encoding_index[slot].opcode = opcodes[t];
+				encoding_index[slot].param = params[t];
+				encoding_index[slot].index = (i << 4) | k;
+				encoding_index[slot].cb = (t == 0);
+			}
+		}
+
+}
+
+
+// Returns the index entry for an instruction, or NULL if there's no match
+struct Encoding* find_encoding(char *opcode, char *param)
+{
+	pthread_once(&tables_once, build_tables);
+
+	unsigned int slot = hash_instruction(opcode, param) & (ENCODING_INDEX_SIZE - 1);
+	for (; encoding_index[slot].opcode; slot = (slot + 1) & (ENCODING_INDEX_SIZE - 1))
+		if (!strcmp(encoding_index[slot].opcode, opcode) &&
+			!strcmp(encoding_index[slot].param, param))
+			return &encoding_index[slot];
+
+	return NULL;
+}
+
+
+// Converts an instruction into machine code and appends it to the output.
+// Returns the number of bytes written, or -1 if it couldn't be parsed.
+int op2hex(struct Context *ctx, char *opcode, char *param, char *args)
+{
+	unsigned char bytes[4];
+	int size = 0;
+
+	// Look up the instruction in the reverse encoding index
+	struct Encoding *entry = find_encoding(opcode, param);
+	if (entry)
+	{
+		if (entry->cb)
+			bytes[size++] = 0xCB;
+		bytes[size++] = entry->index;
+
+		// Arguments are already in little-endian order
+		int args_len = strlen(args) & ~1;
+		if (hex_decode(bytes + size, args, args_len) >= 0)
+		{
+			set_error(ctx, GB_ERROR_PARSE, "Couldn't parse [%s %s] on line %d", opcode, param, ctx->line_num);
+			return -1;
+		}
+		size += args_len / 2;
+
+		buffer_append(&ctx->machine_code, bytes, size);
+		return size;
+	}
+
+	// Ollie into the sun if no match
+	set_error(ctx, GB_ERROR_PARSE, "Couldn't parse [%s %s] on line %d", opcode, param, ctx->line_num);
+	return -1;
+}
+
+
+// FNV-1a hash of a label name
+unsigned int hash_string(char *str)
+{
+	unsigned int hash = 2166136261u;
+	for (; *str; str++)
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+	return hash;
+}
+
+
+// Returns the label with the given name, or NULL if it isn't defined (yet)
+struct Label* find_label(struct Context *ctx, char *name)
+{
+	if (!ctx->label_capacity)
+		return NULL;
+
+	unsigned int slot = hash_string(name) & (ctx->label_capacity - 1);
+	for (; ctx->labels[slot].name; slot = (slot + 1) & (ctx->label_capacity - 1))
+		if (!strcmp(ctx->labels[slot].name, name))
+			return &ctx->labels[slot];
+
+	return NULL;
+}
+
+
+// Defines a label at the given address
+int add_label(struct Context *ctx, char *name, unsigned int address)
+{
+	struct Label *existing = find_label(ctx, name);
+	if (existing)
+		return set_error(ctx, GB_ERROR_DUPLICATE_LABEL, "Label [%s] on line %d was already defined on line %d", name, ctx->line_num, existing->line);
+
+	// Keep the table at most half full, rehashing into double the space
+	if ((ctx->label_count + 1) * 2 > ctx->label_capacity)
+	{
+		struct Label *old = ctx->labels;
+		int old_capacity = ctx->label_capacity;
+
+		ctx->label_capacity = (ctx->label_capacity ? ctx->label_capacity * 2 : 64);
+		ctx->labels = calloc(ctx->label_capacity, sizeof(*ctx->labels));
+
+		for (int i = 0; i < old_capacity; i++)
+			if (old[i].name)
+			{
+				unsigned int slot = hash_string(old[i].name) & (ctx->label_capacity - 1);
+				while (ctx->labels[slot].name)
+					slot = (slot + 1) & (ctx->label_capacity - 1);
+				ctx->labels[slot] = old[i];
+			}
+		free(old);
+	}
+
+	unsigned int slot = hash_string(name) & (ctx->label_capacity - 1);
+	while (ctx->labels[slot].name)
+		slot = (slot + 1) & (ctx->label_capacity - 1);
+
+	ctx->labels[slot].name = arena_strdup(&ctx->names, name);
+	ctx->labels[slot].address = address;
+	ctx->labels[slot].line = ctx->line_num;
+	ctx->label_count++;
+	return GB_OK;
+}
+
+
+// Records a label reference to patch once every label is known
+void add_fixup(struct Context *ctx, char *name, int relative, int position, unsigned int address, int fixed)
+{
+	if (ctx->fixup_count == ctx->fixup_capacity)
+	{
+		ctx->fixup_capacity = (ctx->fixup_capacity ? ctx->fixup_capacity * 2 : 64);
+		ctx->fixups = realloc(ctx->fixups, ctx->fixup_capacity * sizeof(*ctx->fixups));
+	}
+
+	ctx->fixups[ctx->fixup_count].name = name;
+	ctx->fixups[ctx->fixup_count].position = position;
+	ctx->fixups[ctx->fixup_count].address = address;
+	ctx->fixups[ctx->fixup_count].line = ctx->line_num;
+	ctx->fixups[ctx->fixup_count].fixed = fixed;
+	ctx->fixups[ctx->fixup_count++].relative = relative;
+}
+
+
+// Patches every label reference into the machine code (second pass)
+int resolve_labels(struct Context *ctx)
+{
+	int result = GB_OK;
+
+	if (ctx->optimize)
+		optimize_code(ctx);
+	if (ctx->relax)
+		relax_jumps(ctx);
+
+	for (int i = 0; i < ctx->fixup_count; i++)
+	{
+		struct Fixup *fixup = &ctx->fixups[i];
+		struct Label *target = find_label(ctx, fixup->name);
+
+		if (!target)
+		{
+			result = set_error(ctx, GB_ERROR_UNDEFINED_LABEL, "Undefined label [%s] on line %d", fixup->name, fixup->line);
+			break;
+		}
+		if ((result = patch_fixup(ctx, fixup, target)))
+			break;
+	}
+
+	ctx->fixup_count = 0;
+
+	return result;
+}
+
+
+// Patches one label reference into the machine code
+int patch_fixup(struct Context *ctx, struct Fixup *fixup, struct Label *target)
+{
+	if (fixup->relative)
+	{
+		// Relative to the address following the 2-byte jr
+		int distance = (int)target->address - (int)(fixup->address + 2);
+		if (distance < -128 || distance > 127)
+			return set_error(ctx, GB_ERROR_JUMP_RANGE, "Label [%s] is out of range for jr on line %d (%d bytes away)", fixup->name, fixup->line, distance);
+		ctx->machine_code.data[fixup->position] = distance & 0xFF;
+	}
+	else
+	{
+		ctx->machine_code.data[fixup->position] = target->address & 0xFF;
+		ctx->machine_code.data[fixup->position + 1] = (target->address >> 8) & 0xFF;
+	}
+	return GB_OK;
+}
+
+
+// Registers and flags that an instruction reads and writes, for the
+// optimizer's liveness analysis. Anything it can't be sure about counts as
+// read, and nothing counts as written unless it always is.
+void instruction_effects(unsigned char *bytes, unsigned int *use, unsigned int *def)
+{
+	// B, C, D, E, H, L, (HL), A
+	unsigned int regs[8] = {REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, REG_H | REG_L, REG_A};
+	unsigned int pairs[4] = {REG_B | REG_C, REG_D | REG_E, REG_H | REG_L, REG_SP};
+	unsigned char op = bytes[0];
+	unsigned int dst = regs[(op >> 3) & 7];
+	unsigned int src = regs[op & 7];
+	unsigned int pair = pairs[(op >> 4) & 3];
+
+	*use = 0;
+	*def = 0;
+
+	// Prefixed rotates, shifts, bit tests and bit changes
+	if (op == 0xCB)
+	{
+		unsigned char cb = bytes[1];
+		unsigned int reg = regs[cb & 7];
+		*use = reg;
+		if (cb < 0x40)
+		{
+			if ((cb & 0xF0) == 0x10)
+				*use |= REG_FC;
+			*def = REG_FLAGS;
+		}
+		else if (cb < 0x80)
+			*def = REG_FZ | REG_FN | REG_FH;
+		if (cb < 0x40 || cb >= 0x80)
+			*def |= ((cb & 7) == 6 ? 0 : reg);
+		return;
+	}
+
+	// ld r,r'
+	if (op >= 0x40 && op < 0x80 && op != 0x76)
+	{
+		*use = src | ((op & 0x38) == 0x30 ? REG_H | REG_L : 0);
+		*def = ((op & 0x38) == 0x30 ? 0 : dst);
+		return;
+	}
+
+	// 8-bit arithmetic, with a register or an immediate
+	if ((op >= 0x80 && op < 0xC0) || (op >= 0xC0 && (op & 7) == 6))
+	{
+		int alu = (op >> 3) & 7;
+		*use = REG_A | (op < 0xC0 ? src : 0) | (alu == 1 || alu == 3 ? REG_FC : 0);
+		*def = REG_FLAGS | (alu == 7 ? 0 : REG_A);
+		return;
+	}
+
+	if (op < 0x40)
+		switch (op & 0xF)
+		{
+			// ld rr,nn
+			case 0x1:
+				*def = pair;
+				return;
+			// ld (rr),a and ld (hl+/-),a
+			case 0x2:
+				*use = REG_A | (op < 0x20 ? pair : REG_H | REG_L);
+				*def = (op < 0x20 ? 0 : REG_H | REG_L);
+				return;
+			// ld a,(rr) and ld a,(hl+/-)
+			case 0xA:
+				*use = (op < 0x20 ? pair : REG_H | REG_L);
+				*def = REG_A | (op < 0x20 ? 0 : REG_H | REG_L);
+				return;
+			// inc rr, dec rr
+			case 0x3:
+			case 0xB:
+				*use = pair;
+				*def = pair;
+				return;
+			// add hl,rr
+			case 0x9:
+				*use = REG_H | REG_L | pair;
+				*def = REG_H | REG_L | REG_FN | REG_FH | REG_FC;
+				return;
+			// inc r, dec r
+			case 0x4: case 0x5: case 0xC: case 0xD:
+				*use = dst | ((op & 0x38) == 0x30 ? REG_H | REG_L : 0);
+				*def = REG_FZ | REG_FN | REG_FH | ((op & 0x38) == 0x30 ? 0 : dst);
+				return;
+			// ld r,n
+			case 0x6: case 0xE:
+				*use = ((op & 0x38) == 0x30 ? REG_H | REG_L : 0);
+				*def = ((op & 0x38) == 0x30 ? 0 : dst);
+				return;
+		}
+
+	switch (op)
+	{
+		case 0x00: case 0x10: case 0x76: case 0xF3: case 0xFB:
+			return;
+		// rlca, rrca
+		case 0x07: case 0x0F:
+			*use = REG_A;
+			*def = REG_A | REG_FLAGS;
+			return;
+		// rla, rra
+		case 0x17: case 0x1F:
+			*use = REG_A | REG_FC;
+			*def = REG_A | REG_FLAGS;
+			return;
+		// ld (nn),sp
+		case 0x08:
+			*use = REG_SP;
+			return;
+		// daa
+		case 0x27:
+			*use = REG_A | REG_FN | REG_FH | REG_FC;
+			*def = REG_A | REG_FZ | REG_FH | REG_FC;
+			return;
+		// cpl
+		case 0x2F:
+			*use = REG_A;
+			*def = REG_A | REG_FN | REG_FH;
+			return;
+		// scf, ccf
+		case 0x37:
+			*def = REG_FN | REG_FH | REG_FC;
+			return;
+		case 0x3F:
+			*use = REG_FC;
+			*def = REG_FN | REG_FH | REG_FC;
+			return;
+		// Jumps only read their condition
+		case 0x18: case 0xC3:
+			return;
+		case 0x20: case 0x28: case 0xC2: case 0xCA:
+			*use = REG_FZ;
+			return;
+		case 0x30: case 0x38: case 0xD2: case 0xDA:
+			*use = REG_FC;
+			return;
+		case 0xE9:
+			*use = REG_H | REG_L;
+			return;
+		// pop rr
+		case 0xC1: case 0xD1: case 0xE1:
+			*use = REG_SP;
+			*def = REG_SP | pairs[(op >> 4) & 3];
+			return;
+		case 0xF1:
+			*use = REG_SP;
+			*def = REG_SP | REG_A | REG_FLAGS;
+			return;
+		// push rr
+		case 0xC5: case 0xD5: case 0xE5:
+			*use = REG_SP | pairs[(op >> 4) & 3];
+			*def = REG_SP;
+			return;
+		case 0xF5:
+			*use = REG_SP | REG_A | REG_FLAGS;
+			*def = REG_SP;
+			return;
+		// ldh and the other loads through A
+		case 0xE0: case 0xEA:
+			*use = REG_A;
+			return;
+		case 0xF0: case 0xFA:
+			*def = REG_A;
+			return;
+		case 0xE2:
+			*use = REG_A | REG_C;
+			return;
+		case 0xF2:
+			*use = REG_C;
+			*def = REG_A;
+			return;
+		// Stack pointer arithmetic
+		case 0xE8:
+			*use = REG_SP;
+			*def = REG_SP | REG_FLAGS;
+			return;
+		case 0xF8:
+			*use = REG_SP;
+			*def = REG_H | REG_L | REG_FLAGS;
+			return;
+		case 0xF9:
+			*use = REG_H | REG_L;
+			*def = REG_SP;
+			return;
+	}
+
+	// Calls, returns, resets and unused opcodes could read anything
+	*use = REG_ALL;
+}
+
+
+// Works out which registers and flags are live after each instruction,
+// following jumps that stay within the code. Everything is live wherever
+// the code can leave (or might, like calls).
+void compute_liveness(struct Optimized *code, int count)
+{
+	for (int i = 0; i < count; i++)
+		code[i].live = 0;
+
+	for (int changed = 1; changed;)
+	{
+		changed = 0;
+		for (int i = count - 1; i >= 0; i--)
+		{
+			struct Optimized *ins = &code[i];
+			unsigned char op = ins->bytes[0];
+			unsigned int live = 0;
+
+			// Falling through to the next instruction, or off the end
+			char unconditional = (op == 0x18 || op == 0xC3 || op == 0xC9 || op == 0xD9 || op == 0xE9);
+			if (!unconditional)
+				live |= (i + 1 < count ? code[i + 1].in : REG_ALL);
+
+			// Jumping, to a known instruction or somewhere else
+			if (ins->target >= 0)
+				live |= code[ins->target].in;
+			else if (ins->jump)
+				live |= REG_ALL;
+
+			unsigned int in = ins->use | (live & ~ins->def);
+			if (live != ins->live || in != ins->in)
+			{
+				ins->live = live;
+				ins->in = in;
+				changed = 1;
+			}
+		}
+	}
+}
+
+
+// Shrinks the assembled code with rewrites that don't change what it does
+// (-O), before the label references are patched. Prints what it changed.
+void optimize_code(struct Context *ctx)
+{
+	unsigned char *bytes = ctx->machine_code.data;
+	int len = ctx->machine_code.size;
+	struct Optimized *code = malloc((len + 1) * sizeof(struct Optimized));
+	int *index = malloc((len + 1) * sizeof(int));
+	char *pinned = calloc(len + 1, 1);
+	int count = 0;
+	int saved = 0;
+
+	// Split the code into instructions (every byte the assembler wrote is
+	// part of one)
+	for (int pos = 0; pos < len;)
+	{
+		struct Optimized *ins = &code[count];
+		memset(ins, 0, sizeof(*ins));
+		ins->size = instruction_size(bytes + pos, len - pos);
+		if (ins->size > len - pos)
+			ins->size = len - pos;
+		memcpy(ins->bytes, bytes + pos, ins->size);
+		ins->start = pos;
+		ins->fixup = -1;
+		ins->target = -1;
+		for (int k = 0; k < ins->size; k++)
+			index[pos + k] = (k ? -1 : count);
+		pos += ins->size;
+		count++;
+	}
+	index[len] = count;
+
+	for (int f = 0; f < ctx->fixup_count; f++)
+	{
+		struct Fixup *fixup = &ctx->fixups[f];
+		int at = (int)fixup->address - ctx->offset;
+		if (at >= 0 && at < len && index[at] >= 0)
+			code[index[at]].fixup = f;
+	}
+
+	// Labels are where jumps can land
+	for (int l = 0; l < ctx->label_capacity; l++)
+	{
+		int at = (int)ctx->labels[l].address - ctx->offset;
+		if (ctx->labels[l].name && at >= 0 && at < len && index[at] >= 0)
+			code[index[at]].entry = 1;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		struct Optimized *ins = &code[i];
+		unsigned char op = ins->bytes[0];
+		char relative = (op == 0x18 || op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38);
+		char absolute = (op == 0xC2 || op == 0xC3 || op == 0xCA || op == 0xD2 || op == 0xDA ||
+			op == 0xC4 || op == 0xCC || op == 0xD4 || op == 0xDC || op == 0xCD);
+		int target = -1;
+
+		ins->jump = (relative || (absolute && (op & 7) != 4 && op != 0xCD) || op == 0xE9);
+		instruction_effects(ins->bytes, &ins->use, &ins->def);
+
+		// Where label references and numeric jumps go
+		if (ins->fixup >= 0)
+		{
+			struct Label *label = find_label(ctx, ctx->fixups[ins->fixup].name);
+			if (label)
+				target = (int)label->address - ctx->offset;
+		}
+		else if (relative && ins->size == 2)
+			target = ins->start + 2 + (signed char)ins->bytes[1];
+		else if (absolute && ins->size == 3)
+			target = (ins->bytes[1] | ins->bytes[2] << 8) - ctx->offset;
+
+		if (target >= 0 && target < len && index[target] >= 0 && (ins->jump || absolute))
+		{
+			ins->target = (ins->jump ? index[target] : -1);
+			code[index[target]].entry = 1;
+		}
+	}
+
+	pin_code(ctx, pinned);
+	for (int i = 0; i < count; i++)
+		code[i].pinned = pinned[code[i].start];
+
+	emit(ctx, "\nOptimizations:\n\n");
+
+	// Rewrite until nothing else can be
+	for (int changed = 1; changed;)
+	{
+		changed = 0;
+		compute_liveness(code, count);
+
+		for (int i = 0; i < count; i++)
+		{
+			struct Optimized *ins = &code[i];
+			struct Optimized *next = (i + 1 < count ? &code[i + 1] : NULL);
+			unsigned char *b = ins->bytes;
+			unsigned char rewrite[MAX_INSTRUCTION_SIZE];
+			int size = -1;
+			char merge = 0;
+
+			if (ins->removed)
+				continue;
+
+			// The instruction before, if nothing can jump in between
+			int previous = i - 1;
+			for (; previous >= 0 && code[previous].removed && !code[previous + 1].entry; previous--);
+			if (previous >= 0 && (code[previous + 1].entry || code[previous].removed))
+				previous = -1;
+
+			if (ins->pinned || ins->fixup >= 0)
+				continue;
+
+			// ld a,$00 -> xor a, if nothing reads the flags it changes
+			if (b[0] == 0x3E && b[1] == 0x00 && !(ins->live & REG_FLAGS))
+				rewrite[0] = 0xAF, size = 1;
+			// cp $00 -> or a, which only differs in N
+			else if (b[0] == 0xFE && b[1] == 0x00 && !(ins->live & REG_FN))
+				rewrite[0] = 0xB7, size = 1;
+			// or $00 / xor $00 -> or a, and $FF -> and a
+			else if ((b[0] == 0xF6 || b[0] == 0xEE) && b[1] == 0x00)
+				rewrite[0] = 0xB7, size = 1;
+			else if (b[0] == 0xE6 && b[1] == 0xFF)
+				rewrite[0] = 0xA7, size = 1;
+			// add a,$01 -> inc a, sub $01 -> dec a, if nothing reads carry
+			else if ((b[0] == 0xC6 || b[0] == 0xD6) && b[1] == 0x01 && !(ins->live & REG_FC))
+				rewrite[0] = (b[0] == 0xC6 ? 0x3C : 0x3D), size = 1;
+			// call to a reset vector -> rst
+			else if (b[0] == 0xCD && !(b[1] & ~0x38) && b[2] == 0x00)
+				rewrite[0] = 0xC7 | b[1], size = 1;
+			// ld a,($FFnn) -> ldh a,($nn), and the same for stores
+			else if ((b[0] == 0xFA || b[0] == 0xEA) && ins->size == 3 && b[2] == 0xFF)
+				rewrite[0] = b[0] & ~0x0A, rewrite[1] = b[1], size = 2;
+			// ld (hl),a / inc hl -> ld (hl+),a, and the others like it
+			else if ((b[0] == 0x77 || b[0] == 0x7E) && next && !next->removed && !next->entry && !next->pinned &&
+				(next->bytes[0] == 0x23 || next->bytes[0] == 0x2B))
+			{
+				rewrite[0] = (b[0] == 0x77 ? 0x22 : 0x2A) | (next->bytes[0] == 0x2B ? 0x10 : 0);
+				size = 1;
+				merge = 1;
+			}
+			// ld r,r does nothing
+			else if (b[0] >= 0x40 && b[0] < 0x80 && b[0] != 0x76 && (b[0] >> 3 & 7) == (b[0] & 7))
+				size = 0;
+			// ld r,r' right after ld r',r does nothing either
+			else if (b[0] >= 0x40 && b[0] < 0x80 && (b[0] & 7) != 6 && (b[0] & 0x38) != 0x30 && previous >= 0 &&
+				code[previous].bytes[0] == (0x40 | (b[0] & 7) << 3 | (b[0] >> 3 & 7)))
+				size = 0;
+			// Loads into registers that are never read before being written
+			else if (((b[0] >= 0x40 && b[0] < 0x80 && (b[0] & 7) != 6 && (b[0] & 0x38) != 0x30) ||
+				((b[0] & 0xC7) == 0x06 && b[0] != 0x36) || b[0] == 0x01 || b[0] == 0x11 || b[0] == 0x21) &&
+				ins->size == instruction_size(b, MAX_INSTRUCTION_SIZE) && !(ins->def & ins->live))
+				size = 0;
+
+			if (size < 0)
+				continue;
+
+			// Report the change
+			char before[64], after[32];
+			instruction_text(before, ins->bytes, ins->size);
+			if (merge)
+			{
+				char second[32];
+				instruction_text(second, next->bytes, next->size);
+				sprintf(before + strlen(before), " / %s", second);
+			}
+			if (size)
+				instruction_text(after, rewrite, size);
+			else
+				strcpy(after, "(removed)");
+
+			int gain = ins->size - size + (merge ? next->size : 0);
+			emit(ctx, "%4X  %-22s -> %-14s %d byte%s\n", ctx->offset + ins->start, before, after, gain, (gain == 1 ? "" : "s"));
+			saved += gain;
+
+			memcpy(ins->bytes, rewrite, size);
+			ins->size = size;
+			ins->removed = !size;
+			instruction_effects(ins->bytes, &ins->use, &ins->def);
+			if (size == 0)
+				ins->use = ins->def = 0;
+			if (merge)
+			{
+				next->removed = 1;
+				next->size = 0;
+				next->use = next->def = 0;
+				i++;
+			}
+			changed = 1;
+		}
+	}
+
+	if (saved)
+		emit(ctx, "\nSaved %d byte%s\n", saved, (saved == 1 ? "" : "s"));
+	else
+		emit(ctx, "Nothing to optimize\n");
+
+	// Lay the code out again, and move the labels and references with it
+	int *moved = malloc((len + 1) * sizeof(int));
+	int pos = 0;
+	for (int i = 0; i < count; i++)
+	{
+		for (int k = code[i].start; k < (i + 1 < count ? code[i + 1].start : len); k++)
+			moved[k] = pos + (k - code[i].start < code[i].size ? k - code[i].start : 0);
+		memcpy(bytes + pos, code[i].bytes, code[i].size);
+		pos += code[i].size;
+	}
+	moved[len] = pos;
+	ctx->machine_code.size = pos;
+
+	for (int l = 0; l < ctx->label_capacity; l++)
+	{
+		int at = (int)ctx->labels[l].address - ctx->offset;
+		if (ctx->labels[l].name && at >= 0 && at <= len)
+			ctx->labels[l].address = ctx->offset + moved[at];
+	}
+	for (int f = 0; f < ctx->fixup_count; f++)
+	{
+		struct Fixup *fixup = &ctx->fixups[f];
+		int at = (int)fixup->address - ctx->offset;
+		if (at >= 0 && at <= len)
+		{
+			fixup->position = moved[fixup->position];
+			fixup->address = ctx->offset + moved[at];
+		}
+	}
+
+	free(code);
+	free(index);
+	free(pinned);
+	free(moved);
+}
+
+
+// Marks the bytes that must keep their addresses. Numeric jumps into the
+// code can't follow it as it changes size, so nothing between them and their
+// target may, and neither may anything before an address in the code (jumps,
+// calls and loads alike). Label references follow it and are left alone.
+void pin_code(struct Context *ctx, char *pinned)
+{
+	unsigned char *bytes = ctx->machine_code.data;
+	int len = ctx->machine_code.size;
+	char *referenced = calloc(len + 1, 1);
+
+	for (int f = 0; f < ctx->fixup_count; f++)
+	{
+		int at = (int)ctx->fixups[f].address - ctx->offset;
+		if (at >= 0 && at < len)
+			referenced[at] = 1;
+	}
+
+	for (int pos = 0, size; pos < len; pos += size)
+	{
+		unsigned char op = bytes[pos];
+		size = instruction_size(bytes + pos, len - pos);
+		if (size > len - pos)
+			size = len - pos;
+
+		if (referenced[pos])
+			continue;
+
+		if ((op == 0x18 || (op & 0xE7) == 0x20) && size == 2)
+		{
+			int target = pos + 2 + (signed char)bytes[pos + 1];
+			int from = (target < pos ? target : pos);
+			int to = (target < pos ? pos + 2 : target);
+			for (int k = (from < 0 ? 0 : from); k < to && k <= len; k++)
+				pinned[k] = 1;
+		}
+		else if (size == 3 && op != 0xCB && op != 0x10)
+		{
+			int address = (bytes[pos + 1] | bytes[pos + 2] << 8) - ctx->offset;
+			if (address >= 0 && address <= len)
+				memset(pinned, 1, address);
+		}
+	}
+
+	free(referenced);
+}
+
+
+// Picks jr or jp for every label jump, whichever is shorter and still
+// reaches. Every jump starts out as jr, and the ones that can't reach grow
+// into jp until they all can, since growing one moves the others' targets.
+void relax_jumps(struct Context *ctx)
+{
+	static const char *conditions[] = {"nz,", "z,", "nc,", "c,"};
+	unsigned char *bytes = ctx->machine_code.data;
+	int len = ctx->machine_code.size;
+	char *pinned = calloc(len + 1, 1);
+	int *jump_at = malloc((len + 1) * sizeof(int));
+	int *moved = malloc((len + 1) * sizeof(int));
+	int *starts = malloc((ctx->fixup_count + 1) * sizeof(int));
+	int *targets = malloc((ctx->fixup_count + 1) * sizeof(int));
+	char *sizes = malloc(ctx->fixup_count + 1);
+	struct Buffer relaxed = {0};
+	int count = 0;
+	int saved = 0;
+
+	pin_code(ctx, pinned);
+	for (int pos = 0; pos <= len; pos++)
+		jump_at[pos] = -1;
+
+	// Label jumps that may change size ("jp!" and "jr!" stay as written)
+	for (int f = 0; f < ctx->fixup_count; f++)
+	{
+		struct Fixup *fixup = &ctx->fixups[f];
+		struct Label *label = find_label(ctx, fixup->name);
+		int at = (int)fixup->address - ctx->offset;
+
+		if (fixup->fixed || !label || at < 0 || at >= len || pinned[at] || jump_at[at] >= 0)
+			continue;
+		if (bytes[at] != 0x18 && (bytes[at] & 0xE7) != 0x20 && bytes[at] != 0xC3 && (bytes[at] & 0xE7) != 0xC2)
+			continue;
+
+		starts[count] = at;
+		targets[count] = (int)label->address - ctx->offset;
+		if (targets[count] < 0 || targets[count] > len)
+			continue;
+		sizes[count] = 2;
+		jump_at[at] = count++;
+	}
+
+	emit(ctx, "\nBranches:\n\n");
+
+	// Lay the code out and grow the jumps that can't reach, until none do
+	for (int changed = 1; changed;)
+	{
+		changed = 0;
+		for (int pos = 0, shift = 0; pos <= len; pos++)
+		{
+			moved[pos] = pos + shift;
+			if (jump_at[pos] >= 0)
+				shift += sizes[jump_at[pos]] - instruction_size(bytes + pos, MAX_INSTRUCTION_SIZE);
+		}
+
+		for (int j = 0; j < count; j++)
+		{
+			int distance = moved[targets[j]] - (moved[starts[j]] + 2);
+			if (sizes[j] == 2 && (distance < -128 || distance > 127))
+			{
+				sizes[j] = 3;
+				changed = 1;
+			}
+		}
+	}
+
+	// Write the code out again with the new jumps
+	for (int pos = 0; pos < len;)
+	{
+		int j = jump_at[pos];
+		if (j < 0)
+		{
+			buffer_append(&relaxed, bytes + pos, 1);
+			pos++;
+			continue;
+		}
+
+		unsigned char op = bytes[pos];
+		unsigned char jump[3] = {0};
+		char relative = (op == 0x18 || (op & 0xE7) == 0x20);
+		int size = (relative ? 2 : 3);
+
+		if (sizes[j] == 2)
+			jump[0] = (relative ? op : (op == 0xC3 ? 0x18 : op - 0xA2));
+		else
+			jump[0] = (relative ? (op == 0x18 ? 0xC3 : op + 0xA2) : op);
+		buffer_append(&relaxed, jump, sizes[j]);
+
+		// Report the change
+		if (sizes[j] != size)
+		{
+			struct Fixup *fixup = &ctx->fixups[0];
+			for (; (int)fixup->address - ctx->offset != pos; fixup++);
+
+			char before[64], after[64];
+			const char *condition = ((op & 0xE7) == 0x20 || (op & 0xE7) == 0xC2 ? conditions[op >> 3 & 3] : "");
+			snprintf(before, sizeof(before), "%s %s%s", (relative ? "jr" : "jp"), condition, fixup->name);
+			snprintf(after, sizeof(after), "%s %s%s", (relative ? "jp" : "jr"), condition, fixup->name);
+
+			if (relative)
+				emit(ctx, "%4X  %-22s -> %-14s out of range\n", ctx->offset + pos, before, after);
+			else
+				emit(ctx, "%4X  %-22s -> %-14s 1 byte\n", ctx->offset + pos, before, after);
+			saved += size - sizes[j];
+		}
+		pos += size;
+	}
+
+	if (saved > 0)
+		emit(ctx, "\nSaved %d byte%s\n", saved, (saved == 1 ? "" : "s"));
+	else if (saved < 0)
+		emit(ctx, "\nAdded %d byte%s\n", -saved, (saved == -1 ? "" : "s"));
+	else
+		emit(ctx, "Nothing to relax\n");
+
+	// Move the labels and references with the code
+	for (int l = 0; l < ctx->label_capacity; l++)
+	{
+		int at = (int)ctx->labels[l].address - ctx->offset;
+		if (ctx->labels[l].name && at >= 0 && at <= len)
+			ctx->labels[l].address = ctx->offset + moved[at];
+	}
+	for (int f = 0; f < ctx->fixup_count; f++)
+	{
+		struct Fixup *fixup = &ctx->fixups[f];
+		int at = (int)fixup->address - ctx->offset;
+		if (at < 0 || at > len)
+			continue;
+		if (jump_at[at] >= 0)
+		{
+			fixup->relative = (sizes[jump_at[at]] == 2);
+			fixup->position = moved[at] + 1;
+		}
+		else
+			fixup->position = moved[fixup->position];
+		fixup->address = ctx->offset + moved[at];
+	}
+
+	free(ctx->machine_code.data);
+	ctx->machine_code = relaxed;
+
+	free(pinned);
+	free(jump_at);
+	free(moved);
+	free(starts);
+	free(targets);
+	free(sizes);
+}
+
+
+// Converts machine code to asm and prints the results
+void hex_to_asm(struct Context *ctx, unsigned char *bytes, int len, int bgb)
+{
+	emit(ctx, "\n%sgbz80 Assembly:\n\n", (bgb ? "BGB " : ""));
+
+	// Loop through each opcode
+	for (int i = 0; i < len;)
+		i += print_instruction(ctx, bytes + i, len - i, bgb);
+
+	flush_listing(ctx);
+}
+
+
+// Disassembles raw bytes from a stream as they're read. Only one chunk is
+// kept in memory; the last few bytes of a chunk are carried over to the next
+// one so instructions straddling the boundary are decoded whole.
+void stream_to_asm(struct Context *ctx, FILE *file, int bgb)
+{
+	unsigned char buffer[STREAM_CHUNK_SIZE];
+	int size = 0;
+	int read;
+
+	emit(ctx, "\n%sgbz80 Assembly:\n\n", (bgb ? "BGB " : ""));
+
+	do
+	{
+		read = fread(buffer + size, 1, sizeof(buffer) - size, file);
+		size += read;
+
+		// Hold back a possibly incomplete instruction, unless that's the end
+		int i = 0;
+		while (size - i >= MAX_INSTRUCTION_SIZE || (!read && i < size))
+			i += print_instruction(ctx, buffer + i, size - i, bgb);
+
+		size -= i;
+		memmove(buffer, buffer + i, size);
+	}
+	while (read);
+
+	flush_listing(ctx);
+}
+
+
+// Converts hex read from a stream to asm, bgb, gen1, gen2 or joy output as
+// it comes in, printing each instruction, item or byte's buttons as soon as
+// the bytes it needs are there. Whitespace is skipped and a trailing odd
+// nybble becomes the high nybble of the last byte, as with parse_hex. Only
+// a chunk of input is held at a time (and for joy, the bytes whose buttons
+// aren't decided yet).
+int stream_hex(struct Context *ctx, FILE *file, char *format)
+{
+	char text[STREAM_CHUNK_SIZE];
+	char digits[STREAM_CHUNK_SIZE + 1];
+	unsigned char bytes[STREAM_CHUNK_SIZE / 2 + MAX_INSTRUCTION_SIZE];
+	int digit_count = 0;
+	int size = 0;
+	int offset = 0;
+	int read;
+	int gen = (!strcmp(format, "gen1") ? 1 : !strcmp(format, "gen2") ? 2 : 0);
+	int bgb = !strcmp(format, "bgb");
+	struct Error errors = {0};
+	struct JoyStream *joy = NULL;
+
+	if (gen)
+	{
+		emit(ctx, "\nItem            Quantity\n");
+		emit(ctx, "========================\n");
+	}
+	else if (!strcmp(format, "joy"))
+	{
+		joy = malloc(sizeof(struct JoyStream));
+		joy->walks = malloc(sizeof(struct JoyWalks));
+		plan_joy_walks(ctx, joy->walks);
+		for (int e = 0; e < JOY_BUTTONS; e++)
+			joy->cost[e] = JOY_UNREACHABLE;
+		joy->cost[JOY_BUTTONS] = 0;
+		joy->first = 0;
+		joy->count = 0;
+		joy->last = JOY_BUTTONS;
+		joy->presses = 3;
+		joy->total = ctx->joy_costs[7] + ctx->joy_costs[4] + ctx->joy_costs[5];
+		emit(ctx, "\nJoypad Values:\n\nA\n");
+	}
+	else
+		emit(ctx, "\n%sgbz80 Assembly:\n\n", (bgb ? "BGB " : ""));
+	flush_listing(ctx);
+
+	do
+	{
+		read = read_available(file, text, sizeof(text));
+
+		// Keep the digits, carrying an odd one over to the next read
+		for (int i = 0; i < read; i++, offset++)
+		{
+			char c = text[i];
+			if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+				continue;
+			if (hex_values[(unsigned char)c] > 0xF)
+			{
+				free(joy ? joy->walks : NULL);
+				free(joy);
+				return set_error(ctx, GB_ERROR_PARSE, "Couldn't parse hex digit [%c] at offset %d", c, offset);
+			}
+			digits[digit_count++] = c;
+		}
+
+		int decoded = (read ? digit_count & ~1 : digit_count);
+		hex_decode(bytes + size, digits, decoded);
+		size += (decoded + 1) / 2;
+		digits[0] = digits[decoded];
+		digit_count -= decoded;
+
+		// Print everything that's complete, holding back what might still
+		// be missing its last bytes
+		int i = 0;
+		if (gen)
+			for (int count; (count = (size - i < 2 ? size - i : 2)) == 2 || (!read && count); i += count)
+				print_item(ctx, bytes + i, count, gen, &errors);
+		else if (joy)
+			for (; i < size; i++)
+				joy_stream_byte(ctx, joy, bytes[i]);
+		else
+			while (i < size && (!read || instruction_size(bytes + i, MAX_INSTRUCTION_SIZE) <= size - i))
+				i += print_instruction(ctx, bytes + i, size - i, bgb);
+
+		size -= i;
+		memmove(bytes, bytes + i, size);
+		flush_listing(ctx);
+	}
+	while (read);
+
+	if (gen)
+		print_item_warnings(ctx, &errors);
+	else if (joy)
+	{
+		if (joy->count)
+			joy_stream_decide(ctx, joy, joy->count, joy_cheapest(joy->cost));
+		print_joy_total(ctx, joy->presses, joy->total);
+		free(joy->walks);
+		free(joy);
+	}
+	flush_listing(ctx);
+	return GB_OK;
+}
+
+
+// Assembles source read from a stream line by line, printing its machine
+// code as soon as every label it references is known. Only the bytes from
+// the first reference to a label that isn't defined yet on are held back.
+int stream_asm(struct Context *ctx, FILE *file)
+{
+	int capacity = STREAM_CHUNK_SIZE;
+	int size = 0;
+	int result = GB_OK;
+	int read;
+	char *buffer = malloc(capacity + 1);
+
+	emit(ctx, "\nMachine code: ");
+	flush_listing(ctx);
+
+	do
+	{
+		read = read_available(file, buffer + size, capacity - size);
+		size += read;
+		buffer[size] = 0;
+
+		// Assemble every complete line in the buffer, and the last one
+		// without a newline once the stream ends
+		char *line = buffer;
+		char *newline;
+		while (!result && ((newline = memchr(line, '\n', buffer + size - line)) || (!read && line < buffer + size)))
+		{
+			int labels = ctx->label_count;
+			int fixups = ctx->fixup_count;
+
+			if (newline)
+				*newline = 0;
+			result = asm_to_hex(ctx, line);
+			line = (newline ? newline + 1 : buffer + size);
+
+			// A new label may be what earlier references were waiting on
+			if (!result && (ctx->label_count != labels || ctx->fixup_count != fixups || !ctx->fixup_count))
+				result = stream_fixups(ctx, (ctx->label_count != labels ? 0 : fixups));
+		}
+		flush_listing(ctx);
+
+		// Move the partial line to the front for the next read
+		size -= line - buffer;
+		memmove(buffer, line, size);
+
+		// The partial line fills the buffer, so it needs more room
+		if (size == capacity)
+		{
+			capacity *= 2;
+			buffer = realloc(buffer, capacity + 1);
+		}
+	}
+	while (read && !result);
+
+	free(buffer);
+	if (!result && ctx->fixup_count)
+		result = set_error(ctx, GB_ERROR_UNDEFINED_LABEL, "Undefined label [%s] on line %d", ctx->fixups[0].name, ctx->fixups[0].line);
+	if (!result)
+	{
+		emit(ctx, "\n");
+		flush_listing(ctx);
+	}
+	return result;
+}
+
+
+// Patches the label references of streamed source whose labels are known,
+// from the first one that might be on, and prints the machine code up to
+// the first reference still waiting for its label
+int stream_fixups(struct Context *ctx, int first)
+{
+	int kept = 0;
+	int result = GB_OK;
+
+	for (int i = 0; i < ctx->fixup_count; i++)
+	{
+		struct Fixup *fixup = &ctx->fixups[i];
+		struct Label *target = (i >= first && !result ? find_label(ctx, fixup->name) : NULL);
+
+		if (!target || (result = patch_fixup(ctx, fixup, target)))
+			ctx->fixups[kept++] = *fixup;
+	}
+	ctx->fixup_count = kept;
+	if (result)
+		return result;
+
+	// References are in the order they were assembled
+	int ready = (kept ? ctx->fixups[0].position : ctx->machine_code.size);
+	if (!ready)
+		return GB_OK;
+
+	buffer_reserve(&ctx->listing, ready * 2);
+	hex_encode((char*)ctx->listing.data + ctx->listing.size, ctx->machine_code.data, ready);
+	ctx->listing.size += ready * 2;
+
+	ctx->machine_code.size -= ready;
+	memmove(ctx->machine_code.data, ctx->machine_code.data + ready, ctx->machine_code.size);
+	for (int i = 0; i < kept; i++)
+		ctx->fixups[i].position -= ready;
+	return GB_OK;
+}
+
+
+// Reads whatever a stream has ready, waiting only until there's something,
+// so a pipe is converted as it's fed instead of a whole buffer at a time.
+// Returns 0 once it ends.
+int read_available(FILE *file, char *buffer, int len)
+{
+#ifndef _WIN32
+	int got;
+	do
+		got = read(fileno(file), buffer, len);
+	while (got < 0 && errno == EINTR);
+	return (got > 0 ? got : 0);
+#else
+	return fread(buffer, 1, len, file);
+#endif
+}
+
+
+// Precomputes the mnemonic and parameter part of every listing line, padded
+// the same way the columns have always been printed.
+void build_templates(void)
+{
+	for (int style = 0; style < 3; style++)
+		for (int i = 0; i < 256; i++)
+		{
+			struct Template *t = &templates[style][i];
+			char *instruction, *parameters;
+			int offset = 0;
+
+			if (style == 2)
+			{
+				instruction = cb_opcode_table[i >> 4][i & 0xF];
+				parameters = cb_param_table[i >> 4][i & 0xF];
+			}
+			else if (style == 1)
+			{
+				instruction = bgb_opcode_table[i >> 4][i & 0xF];
+				parameters = bgb_param_table[i >> 4][i & 0xF];
+				t->arg_size = size_table[i >> 4][i & 0xF];
+				offset = bgb_offset_table[i >> 4][i & 0xF];
+			}
+			else
+			{
+				instruction = opcode_table[i >> 4][i & 0xF];
+				parameters = param_table[i >> 4][i & 0xF];
+				t->arg_size = size_table[i >> 4][i & 0xF];
+				offset = offset_table[i >> 4][i & 0xF];
+			}
+
+			// Mnemonics are padded to 5 columns before the parameters
+			int length = sprintf(t->text, "%-5s%s", instruction, parameters);
+			t->length = length;
+			t->arg_pos = (length - strlen(parameters)) + offset;
+		}
+
+}
+
+
+// Appends the listing line for the instruction at the start of the given
+// bytes to the output. Returns the number of bytes it takes up.
+int format_instruction(struct Buffer *out, unsigned char *bytes, int len, int bgb, unsigned int address)
+{
+	char *digits = "0123456789ABCDEF";
+	char line[64];
+	int pos = 0;
+	int i = 0;
+
+	pthread_once(&tables_once, build_tables);
+
+	// An instruction cut short by the end of the input is shown as data, the
+	// way trace mode shows bytes it never reached
+	if (instruction_size(bytes, len) > len)
+	{
+		format_data(out, bytes, len, bgb, address);
+		return len;
+	}
+
+	// Offset, right-aligned to 4 columns
+	char offset[8];
+	int digit_count = 0;
+	do
+		offset[digit_count++] = digits[address & 0xF];
+	while (address >>= 4);
+	for (int x = digit_count; x < 4; x++)
+		line[pos++] = ' ';
+	while (digit_count)
+		line[pos++] = offset[--digit_count];
+	line[pos++] = ' ';
+	line[pos++] = ' ';
+
+	// Check if current byte is prefix CB (and isn't the last byte)
+	int cb = (bytes[0] == 0xCB && len > 1);
+	unsigned char opcode = bytes[cb];
+	struct Template *t = &templates[cb ? 2 : bgb][opcode];
+
+	// Opcode bytes
+	for (; i <= cb; i++)
+	{
+		line[pos++] = digits[bytes[i] >> 4];
+		line[pos++] = digits[bytes[i] & 0xF];
+		line[pos++] = ' ';
+	}
+	int byte_count = i;
+
+	// Special case for the STOP instruction
+	if (!cb && opcode == 0x10)
+	{
+		memcpy(line + pos, "01 ", 3);
+		pos += 3;
+		byte_count++;
+		if (i < len)
+			i++;
+	}
+
+	// Argument bytes, which also go into the parameters (high byte first)
+	int arg_count = (cb ? 0 : t->arg_size);
+	if (arg_count > len - i)
+		arg_count = len - i;
+	for (int x = 0; x < arg_count; x++)
+	{
+		line[pos++] = digits[bytes[i + x] >> 4];
+		line[pos++] = digits[bytes[i + x] & 0xF];
+		line[pos++] = ' ';
+	}
+	byte_count += arg_count;
+
+	// Mnemonics start 17 columns after the offset
+	for (int x = 6 + byte_count * 3; x < 23; x++)
+		line[pos++] = ' ';
+
+	char *text = line + pos;
+	memcpy(text, t->text, t->length);
+	pos += t->length;
+	for (int x = 0; x < arg_count; x++)
+	{
+		char *dest = text + t->arg_pos + (t->arg_size - 1 - x) * 2;
+		dest[0] = digits[bytes[i] >> 4];
+		dest[1] = digits[bytes[i++] & 0xF];
+	}
+	line[pos++] = '\n';
+
+	buffer_append(out, (unsigned char*)line, pos);
+	return i;
+}
+
+
+// Prints the instruction at the start of the given bytes. Returns the
+// number of bytes it takes up.
+int print_instruction(struct Context *ctx, unsigned char *bytes, int len, int bgb)
+{
+	int size = format_instruction(&ctx->listing, bytes, len, bgb, ctx->cur_offset);
+
+	// STOP always shows its (fixed) argument
+	ctx->cur_offset += (size == 1 && bytes[0] == 0x10 ? 2 : size);
+
+	if (ctx->listing.size >= LISTING_BLOCK_SIZE)
+		flush_listing(ctx);
+
+	return size;
+}
+
+
+// Appends a listing line for up to 4 bytes of data
+void format_data(struct Buffer *out, unsigned char *bytes, int count, int bgb, unsigned int address)
+{
+	char *digits = "0123456789ABCDEF";
+	char line[64];
+	int pos = sprintf(line, "%4X  ", address);
+
+	for (int i = 0; i < count; i++)
+		pos += sprintf(line + pos, "%02X ", bytes[i]);
+	for (int x = 6 + count * 3; x < 23; x++)
+		line[pos++] = ' ';
+
+	memcpy(line + pos, "db   ", 5);
+	pos += 5;
+	for (int i = 0; i < count; i++)
+	{
+		if (i)
+			line[pos++] = ',';
+		if (!bgb)
+			line[pos++] = '$';
+		line[pos++] = digits[bytes[i] >> 4];
+		line[pos++] = digits[bytes[i] & 0xF];
+	}
+	line[pos++] = '\n';
+
+	buffer_append(out, (unsigned char*)line, pos);
+}
+
+
+// Returns the size of the instruction at the start of the given bytes, the
+// same way format_instruction reads it
+int instruction_size(unsigned char *bytes, int len)
+{
+	if (bytes[0] == 0xCB)
+		return (len > 1 ? 2 : 1);
+	if (bytes[0] == 0x10)
+		return (len > 1 ? 2 : 1);
+	return 1 + size_table[bytes[0] >> 4][bytes[0] & 0xF];
+}
+
+
+// Disassembles only the code reachable from the entry points, following
+// jp, jr, call, rst and ret. Every byte that's never reached is printed as
+// data instead of being decoded as instructions.
+void trace_to_asm(struct Context *ctx, unsigned char *bytes, int len, int bgb)
+{
+	// One bit per byte for code, and one for the first byte of instructions
+	unsigned char *code = calloc(len / 8 + 1, 1);
+	unsigned char *starts = calloc(len / 8 + 1, 1);
+	int *worklist = malloc(64 * sizeof(int));
+	int work_count = 0;
+	int work_capacity = 64;
+
+	// If the image looks like a ROM, start from its rst and interrupt vectors
+	// and its entry point. The worklist is a stack, so those go in first and
+	// the -ofs offset and user entry points are followed before them.
+	unsigned int vectors[] = {0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38,
+							  0x40, 0x48, 0x50, 0x58, 0x60, 0x100};
+
+	if (!ctx->offset && len >= 0x150)
+		for (int i = 0; i < 14; i++)
+			worklist[work_count++] = vectors[i];
+	for (int i = 0; i < ctx->entry_count; i++)
+	{
+		if (work_count == work_capacity)
+			worklist = realloc(worklist, (work_capacity *= 2) * sizeof(int));
+		worklist[work_count++] = ctx->entry_points[i] - ctx->offset;
+	}
+	if (work_count == work_capacity)
+		worklist = realloc(worklist, (work_capacity *= 2) * sizeof(int));
+	worklist[work_count++] = 0;
+
+	while (work_count)
+	{
+		int pos = worklist[--work_count];
+
+		// Follow this path until it ends or reaches code that's been seen
+		while (pos >= 0 && pos < len && !(code[pos >> 3] & (1 << (pos & 7))))
+		{
+			int size = instruction_size(bytes + pos, len - pos);
+			if (pos + size > len)
+				break;
+
+			starts[pos >> 3] |= 1 << (pos & 7);
+			for (int x = pos; x < pos + size; x++)
+				code[x >> 3] |= 1 << (x & 7);
+
+			unsigned char opcode = bytes[pos];
+			char *instruction = opcode_table[opcode >> 4][opcode & 0xF];
+			char *param = param_table[opcode >> 4][opcode & 0xF];
+			int next = pos + size;
+			int target = -1;
+
+			// Conditional instructions also fall through
+			char conditional = (param[0] == 'n' || param[0] == 'z' ||
+								(param[0] == 'c' && (!param[1] || param[1] == ',')));
+
+			if (opcode == 0xCB)
+				;
+			else if (!strcmp(instruction, "jp") || !strcmp(instruction, "call"))
+			{
+				// jp (hl) goes somewhere we can't know about
+				if (size == 3)
+					target = (bytes[pos + 1] | (bytes[pos + 2] << 8)) - ctx->offset;
+				if (!strcmp(instruction, "jp") && !conditional)
+					next = -1;
+			}
+			else if (!strcmp(instruction, "jr"))
+			{
+				target = next + (signed char)bytes[pos + 1];
+				if (!conditional)
+					next = -1;
+			}
+			else if (!strcmp(instruction, "rst"))
+				target = strtol(param, NULL, 16) - ctx->offset;
+			else if ((!strcmp(instruction, "ret") && !conditional) || !strcmp(instruction, "reti") ||
+					 !strcmp(instruction, "-"))
+				next = -1;
+
+			if (target >= 0 && target < len && !(code[target >> 3] & (1 << (target & 7))))
+			{
+				if (work_count == work_capacity)
+					worklist = realloc(worklist, (work_capacity *= 2) * sizeof(int));
+				worklist[work_count++] = target;
+			}
+
+			pos = next;
+		}
+	}
+
+	// Print instructions where they were found, and everything else as data
+	emit(ctx, "\n%sgbz80 Assembly:\n\n", (bgb ? "BGB " : ""));
+
+	for (int pos = 0; pos < len;)
+	{
+		if (starts[pos >> 3] & (1 << (pos & 7)))
+		{
+			pos += format_instruction(&ctx->listing, bytes + pos, len - pos, bgb, ctx->offset + pos);
+			continue;
+		}
+
+		int count = 0;
+		while (count < 4 && pos + count < len && !(code[(pos + count) >> 3] & (1 << ((pos + count) & 7))))
+			count++;
+		format_data(&ctx->listing, bytes + pos, count, bgb, ctx->offset + pos);
+		pos += count;
+
+		if (ctx->listing.size >= LISTING_BLOCK_SIZE)
+			flush_listing(ctx);
+	}
+	flush_listing(ctx);
+
+	free(code);
+	free(starts);
+	free(worklist);
+}
+
+
+// Disassembles chunks until there are none left. Each chunk is decoded from
+// its first byte, and its last instruction may run into the next chunk.
+void* disassembly_worker(void *arg)
+{
+	struct Disassembly *job = arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&job->lock);
+		int index = job->next_chunk++;
+
+		// Don't get too far ahead of the merge, or finished chunks pile up
+		while (index < job->chunk_count && index >= job->merged + job->thread_count * 4)
+			pthread_cond_wait(&job->chunk_merged, &job->lock);
+		pthread_mutex_unlock(&job->lock);
+
+		if (index >= job->chunk_count)
+			return NULL;
+
+		struct Chunk *chunk = &job->chunks[index];
+		int limit = (chunk->start + job->chunk_size < job->len ? chunk->start + job->chunk_size : job->len);
+		int pos = chunk->start;
+
+		while (pos < limit)
+		{
+			// Remember where each instruction and its line start, so the
+			// merge can pick up from any of them
+			if (chunk->count == chunk->capacity)
+			{
+				chunk->capacity = (chunk->capacity ? chunk->capacity * 2 : (job->chunk_size < 1024 ? job->chunk_size + 1 : 1024));
+				chunk->starts = realloc(chunk->starts, chunk->capacity * sizeof(int));
+				chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(int));
+			}
+			chunk->starts[chunk->count] = pos;
+			chunk->lines[chunk->count++] = chunk->text.size;
+
+			pos += format_instruction(&chunk->text, job->bytes + pos, job->len - pos, job->bgb, job->offset + pos);
+		}
+		chunk->end = pos;
+
+		pthread_mutex_lock(&job->lock);
+		chunk->done = 1;
+		pthread_cond_broadcast(&job->chunk_done);
+		pthread_mutex_unlock(&job->lock);
+	}
+}
+
+
+// Returns the M-cycles the instruction at the start of the given bytes takes
+// without branching, and sets taken to what it takes when it branches (0 if
+// it can't)
+int instruction_cycles(unsigned char *bytes, int len, int *taken)
+{
+	unsigned char opcode = bytes[0];
+
+	*taken = 0;
+	if (opcode == 0xCB && len > 1)
+		return cb_cycle_table[bytes[1] >> 4][bytes[1] & 0xF];
+
+	*taken = branch_cycle_table[opcode >> 4][opcode & 0xF];
+	return cycle_table[opcode >> 4][opcode & 0xF];
+}
+
+
+// Disassembles machine code with the M-cycles each instruction takes, and
+// how many the block it's in has taken so far (taken/not taken for branches).
+// Then estimates the fastest and slowest paths from each entry point (the
+// -ofs offset and -e entry points) to where they leave the code, following
+// jumps and returns but not calls.
+void timing_to_asm(struct Context *ctx, unsigned char *bytes, int len, int bgb)
+{
+	int *block_of = malloc((len + 1) * sizeof(int));
+	char *leader = calloc(len + 1, 1);
+	struct Block *blocks = malloc((len + 1) * sizeof(struct Block));
+	struct Buffer line = {0};
+	int block_count = 0;
+
+	for (int pos = 0; pos <= len; pos++)
+		block_of[pos] = -1;
+
+	// Blocks start at the beginning, at jump targets and after jumps
+	leader[0] = 1;
+	for (int i = 0; i < ctx->entry_count; i++)
+	{
+		int entry = (int)ctx->entry_points[i] - ctx->offset;
+		if (entry >= 0 && entry < len)
+			leader[entry] = 1;
+	}
+	for (int pos = 0; pos < len;)
+	{
+		int size = instruction_size(bytes + pos, len - pos);
+		int target = -1;
+
+		if (pos + size <= len)
+		{
+			unsigned char op = bytes[pos];
+			if (op == 0x18 || (op & 0xE7) == 0x20)
+				target = pos + size + (signed char)bytes[pos + 1];
+			else if (op == 0xC3 || (op & 0xE7) == 0xC2 || op == 0xCD || (op & 0xE7) == 0xC4)
+				target = (bytes[pos + 1] | bytes[pos + 2] << 8) - ctx->offset;
+			else if ((op & 0xC7) == 0xC7)
+				target = (op & 0x38) - ctx->offset;
+
+			if (op == 0x18 || (op & 0xE7) == 0x20 || op == 0xC3 || (op & 0xE7) == 0xC2 ||
+				(op & 0xE7) == 0xC0 || op == 0xC9 || op == 0xD9 || op == 0xE9 || !cycle_table[op >> 4][op & 0xF])
+				leader[pos + size] = 1;
+		}
+		if (target >= 0 && target < len)
+			leader[target] = 1;
+		pos += size;
+	}
+
+	// Print the listing, keeping track of the blocks on the way
+	emit(ctx, "\n%sgbz80 Assembly (M-cycles):\n\n", (bgb ? "BGB " : ""));
+
+	int total = 0;
+	for (int pos = 0; pos < len;)
+	{
+		int taken;
+		int cycles = instruction_cycles(bytes + pos, len - pos, &taken);
+		int start = pos;
+
+		if (leader[pos] || !block_count)
+		{
+			struct Block *block = &blocks[block_count++];
+			block->start = pos;
+			block->fall = -1;
+			block->jump = -1;
+			total = 0;
+		}
+		block_of[pos] = block_count - 1;
+
+		// Cycles line up after the instruction
+		char annotation[32];
+		line.size = 0;
+		pos += format_instruction(&line, bytes + pos, len - pos, bgb, ctx->offset + pos);
+		line.size--;
+		while (line.size < 40)
+			buffer_append(&line, (unsigned char*)" ", 1);
+		if (!cycles)
+			sprintf(annotation, " ; -\n");
+		else if (taken)
+			sprintf(annotation, " ; %d/%-4d %d/%d\n", taken, cycles, total + taken, total + cycles);
+		else
+			sprintf(annotation, " ; %-6d %d\n", cycles, total + cycles);
+		buffer_append(&line, (unsigned char*)annotation, strlen(annotation));
+		buffer_append(&ctx->listing, line.data, line.size);
+		if (ctx->listing.size >= LISTING_BLOCK_SIZE)
+			flush_listing(ctx);
+
+		// Where the block goes from its last instruction
+		struct Block *block = &blocks[block_count - 1];
+		unsigned char op = bytes[start];
+		char complete = (pos - start == instruction_size(bytes + start, MAX_INSTRUCTION_SIZE));
+		total += cycles;
+		block->fall_cost = total;
+		block->jump_cost = -1;
+		block->fall = (pos < len ? -2 : -1);
+
+		if (!cycles)
+			block->fall_cost = -1;
+		else if (!complete)
+			;
+		else if (op == 0x18 || (op & 0xE7) == 0x20 || op == 0xC3 || (op & 0xE7) == 0xC2 || op == 0xE9)
+		{
+			int target = -1;
+			if (op == 0x18 || (op & 0xE7) == 0x20)
+				target = pos + (signed char)bytes[start + 1];
+			else if (op != 0xE9)
+				target = (bytes[start + 1] | bytes[start + 2] << 8) - ctx->offset;
+
+			block->jump_cost = total - cycles + (taken ? taken : cycles);
+			block->jump = (target >= 0 && target < len ? target : -1);
+			if (!taken)
+				block->fall_cost = -1;
+		}
+		else if ((op & 0xE7) == 0xC0 || op == 0xC9 || op == 0xD9)
+		{
+			block->jump_cost = total - cycles + (taken ? taken : cycles);
+			if (!taken)
+				block->fall_cost = -1;
+		}
+	}
+	flush_listing(ctx);
+
+	// Link the blocks up, now that every one has a number. Leaving the code
+	// is -1.
+	for (int b = 0; b < block_count; b++)
+	{
+		struct Block *block = &blocks[b];
+		if (block->fall == -2)
+			block->fall = b + 1;
+		if (block->jump >= 0)
+			block->jump = block_of[block->jump];
+	}
+
+	int entry_count = (!block_count ? 0 : ctx->entry_count ? ctx->entry_count : 1);
+	int *dist = malloc(block_count * sizeof(int));
+	int *longest = malloc(block_count * sizeof(int));
+	int *queue = malloc((block_count * 2 + 2) * sizeof(int));
+	char *state = malloc(block_count);
+
+	if (entry_count)
+		emit(ctx, "\nTiming:\n\n");
+
+	for (int e = 0; e < entry_count; e++)
+	{
+		int entry = (ctx->entry_count ? (int)ctx->entry_points[e] - ctx->offset : 0);
+		if (entry < 0 || entry >= len || block_of[entry] < 0)
+		{
+			emit(ctx, "%4X  Not the start of an instruction\n", ctx->offset + entry);
+			continue;
+		}
+		entry = block_of[entry];
+
+		// Fastest way out, with SPFA over the blocks (loops never help)
+		for (int b = 0; b < block_count; b++)
+		{
+			dist[b] = PATH_UNREACHABLE;
+			state[b] = 0;
+		}
+		int head = 0, tail = 0, fastest = PATH_UNREACHABLE;
+		dist[entry] = 0;
+		queue[tail++] = entry;
+		state[entry] = 1;
+		while (head != tail)
+		{
+			int b = queue[head++];
+			if (head == block_count + 1)
+				head = 0;
+			state[b] = 0;
+
+			int to[2] = {blocks[b].fall, blocks[b].jump};
+			int cost[2] = {blocks[b].fall_cost, blocks[b].jump_cost};
+			for (int k = 0; k < 2; k++)
+			{
+				if (cost[k] < 0)
+					continue;
+				int d = dist[b] + cost[k];
+				if (to[k] < 0)
+				{
+					if (d < fastest)
+						fastest = d;
+				}
+				else if (d < dist[to[k]])
+				{
+					dist[to[k]] = d;
+					if (!state[to[k]])
+					{
+						state[to[k]] = 1;
+						queue[tail++] = to[k];
+						if (tail == block_count + 1)
+							tail = 0;
+					}
+				}
+			}
+		}
+
+		// Slowest way out, with a depth-first search that gives up on loops
+		int loop = -1;
+		int depth = 0;
+		memset(state, 0, block_count);
+		queue[depth++] = entry;
+		while (depth && loop < 0)
+		{
+			int b = queue[depth - 1];
+			int to[2] = {blocks[b].fall, blocks[b].jump};
+			int cost[2] = {blocks[b].fall_cost, blocks[b].jump_cost};
+
+			if (!state[b])
+			{
+				state[b] = 1;
+				for (int k = 0; k < 2; k++)
+					if (cost[k] >= 0 && to[k] >= 0)
+					{
+						if (state[to[k]] == 1)
+							loop = to[k];
+						else if (!state[to[k]])
+							queue[depth++] = to[k];
+					}
+				continue;
+			}
+
+			depth--;
+			if (state[b] == 2)
+				continue;
+			state[b] = 2;
+			longest[b] = -1;
+			for (int k = 0; k < 2; k++)
+				if (cost[k] >= 0 && (to[k] < 0 || longest[to[k]] >= 0) &&
+					cost[k] + (to[k] < 0 ? 0 : longest[to[k]]) > longest[b])
+					longest[b] = cost[k] + (to[k] < 0 ? 0 : longest[to[k]]);
+		}
+
+		emit(ctx, "%4X  ", ctx->offset + blocks[entry].start);
+		if (fastest == PATH_UNREACHABLE)
+		{
+			emit(ctx, "Never leaves the code\n");
+			continue;
+		}
+		emit(ctx, "Fastest %d M-cycles (%d T-cycles, %.2f%% of a frame)\n", fastest, fastest * 4, fastest * 100.0 / FRAME_CYCLES);
+		if (loop >= 0)
+			emit(ctx, "      Slowest unknown, since it loops at %X\n", ctx->offset + blocks[loop].start);
+		else
+			emit(ctx, "      Slowest %d M-cycles (%d T-cycles, %.2f%% of a frame)\n", longest[entry], longest[entry] * 4, longest[entry] * 100.0 / FRAME_CYCLES);
+	}
+	flush_listing(ctx);
+
+	free(block_of);
+	free(leader);
+	free(blocks);
+	free(line.data);
+	free(dist);
+	free(longest);
+	free(queue);
+	free(state);
+}
+
+
+// Disassembles machine code on a pool of threads, one chunk at a time, and
+// prints the chunks in order. The output is identical to hex_to_asm.
+void parallel_to_asm(struct Context *ctx, unsigned char *bytes, int len, int bgb)
+{
+	struct Disassembly job = {.bytes = bytes, .len = len, .bgb = bgb, .offset = ctx->offset, .chunk_size = ctx->chunk_size, .thread_count = ctx->thread_count};
+	pthread_t threads[ctx->thread_count];
+
+	emit(ctx, "\n%sgbz80 Assembly:\n\n", (bgb ? "BGB " : ""));
+	flush_listing(ctx);
+
+	job.chunk_count = (len + ctx->chunk_size - 1) / ctx->chunk_size;
+	job.chunks = calloc(job.chunk_count, sizeof(*job.chunks));
+	for (int k = 0; k < job.chunk_count; k++)
+		job.chunks[k].start = k * ctx->chunk_size;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.chunk_done, NULL);
+	pthread_cond_init(&job.chunk_merged, NULL);
+
+	for (int t = 0; t < ctx->thread_count; t++)
+		pthread_create(&threads[t], NULL, disassembly_worker, &job);
+
+	// Merge the chunks in order as they finish
+	int pos = 0;
+	for (int k = 0; k < job.chunk_count; k++)
+	{
+		struct Chunk *chunk = &job.chunks[k];
+
+		pthread_mutex_lock(&job.lock);
+		while (!chunk->done)
+			pthread_cond_wait(&job.chunk_done, &job.lock);
+		pthread_mutex_unlock(&job.lock);
+
+		// If the previous chunk's last instruction ran into this one, the
+		// worker started mid-instruction. Decode from the real boundary until
+		// it lines up with an instruction the worker also decoded.
+		int limit = (chunk->start + ctx->chunk_size < len ? chunk->start + ctx->chunk_size : len);
+		int line = 0;
+		while (pos < limit)
+		{
+			while (line < chunk->count && chunk->starts[line] < pos)
+				line++;
+			if (line < chunk->count && chunk->starts[line] == pos)
+				break;
+			pos += format_instruction(&ctx->listing, bytes + pos, len - pos, bgb, ctx->offset + pos);
+		}
+		flush_listing(ctx);
+
+		// From there on the worker's output is exactly what a single pass
+		// would have printed
+		if (pos < limit)
+		{
+			ctx->write(ctx->user, (char*)chunk->text.data + chunk->lines[line], chunk->text.size - chunk->lines[line]);
+			pos = chunk->end;
+		}
+
+		free(chunk->text.data);
+		free(chunk->starts);
+		free(chunk->lines);
+
+		pthread_mutex_lock(&job.lock);
+		job.merged++;
+		pthread_cond_broadcast(&job.chunk_merged);
+		pthread_mutex_unlock(&job.lock);
+	}
+
+	for (int t = 0; t < ctx->thread_count; t++)
+		pthread_join(threads[t], NULL);
+
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.chunk_done);
+	pthread_cond_destroy(&job.chunk_merged);
+	free(job.chunks);
+}
+
+
+// Assembles one line of source into the context's machine code
+int asm_to_hex(struct Context *ctx, char *str)
+{
+	struct Lexed line;
+	int unclosed = lex_line(str, &line);
+	char relative = (line.mnemonic[1] == 'r');
+
+	// No instruction on this line
+	if (line.start == line.end)
+	{
+		ctx->line_num++;
+		return GB_OK;
+	}
+
+	// Label names only live until they're copied into the table
+	arena_reset(&ctx->scratch);
+
+	// Update the label table if a label was detected
+	if (line.label)
+	{
+		char *name = lex_name(&ctx->scratch, line.start, line.end, ':');
+
+		// Add current address and label name to the table
+		if (add_label(ctx, (name[0] == '.' ? name + 1 : name), ctx->cur_offset))
+			return GB_ERROR_DUPLICATE_LABEL;
+		ctx->line_num++;
+		return GB_OK;
+	}
+
+	// Words too long to be a mnemonic are shown whole
+	if (line.mnemonic_length >= (int)sizeof(line.mnemonic))
+		return set_error(ctx, GB_ERROR_PARSE, "Couldn't parse [%s %s] on line %d", lex_name(&ctx->scratch, line.start, line.start + line.mnemonic_length, 0), line.operands, ctx->line_num);
+
+	// A '[' has to be closed with a ']'
+	if (unclosed)
+		return set_error(ctx, GB_ERROR_PARSE, "Couldn't parse [%s %s] on line %d", line.mnemonic, line.operands, ctx->line_num);
+
+	// Special case for the STOP instruction
+	if (!strcmp(line.mnemonic, "stop"))
+		strcpy(line.digits, "01");
+
+	// Assemble the instruction into the output buffer
+	int size = op2hex(ctx, line.mnemonic, line.operands, line.digits);
+	if (size < 0)
+		return GB_ERROR_PARSE;
+
+	// Jump targets may be labels that aren't defined yet. The address is
+	// always the last argument of the instruction.
+	if (line.target)
+		add_fixup(ctx, lex_name(&ctx->names, line.target, line.end, 0), relative, ctx->machine_code.size - (relative ? 1 : 2), ctx->cur_offset, line.fixed);
+
+	// These are for jump correction and error handling
+	ctx->cur_offset += size;
+	ctx->line_num++;
+	return GB_OK;
+}
+
+
+// Converts machine code into Gen I/II items for 8F
+void hex_to_gen(struct Context *ctx, unsigned char *bytes, int len, int gen)
+{
+	// Error handler for weird item setups
+	struct Error errors = {0};
+
+	emit(ctx, "\nItem            Quantity\n");
+	emit(ctx, "========================\n");
+
+	for (int i = 0; i < len; i += 2)
+		print_item(ctx, bytes + i, (len - i < 2 ? 1 : 2), gen, &errors);
+
+	print_item_warnings(ctx, &errors);
+	flush_listing(ctx);
+}
+
+
+// Prints the item for the first byte, with the second as its quantity (any
+// quantity will do when count is 1), and notes what's wrong with the pair
+void print_item(struct Context *ctx, unsigned char *bytes, int count, int gen, struct Error *errors)
+{
+	// Place horizontal cursor at line start
+	int h_cursor = 0;
+
+	// Split high and low nybble as indices
+	unsigned char h = bytes[0] >> 4;
+	unsigned char l = bytes[0] & 0xF;
+	char *item = (gen == 1 ? gen1_items[h][l] : gen2_items[h][l]);
+	char quantity[4] = "Any";
+	unsigned char conversion = 0;
+
+	h_cursor += strlen(item);
+
+	// Grab next byte as quantity, otherwise any quantity will do
+	if (count > 1)
+	{
+		conversion = bytes[1];
+		sprintf(quantity, "%d", conversion);
+	}
+
+	// Print item/quantity pairs
+	emit(ctx, "%s", item);
+	for (; h_cursor < 16; h_cursor++)
+		emit(ctx, " ");
+	emit(ctx, "x%s\n", quantity);
+
+	// [Error] Key items with 2+ quantity
+	if ((gen == 1 ? gen1_key_items[h][l] : gen2_key_items[h][l]))
+		if (conversion && conversion != 1)
+			errors->key_quantity = 1;
+	// [Error] Invalid or glitch items
+	if ((gen == 1 ? gen1_glitch_items[h][l] : gen2_glitch_items[h][l]))
+		errors->glitches = 1;
+	// [Error] Duplicate item stacks
+	if (errors->seen_items[h][l] == 1)
+		errors->duplicates = 1;
+	else
+		errors->seen_items[h][l] = 1;
+}
+
+
+// Prints the warnings for everything wrong with an item list
+void print_item_warnings(struct Context *ctx, struct Error *errors)
+{
+	if (ctx->show_warnings)
+		if (errors->key_quantity || errors->glitches || errors->duplicates)
+		{
+			emit(ctx, "\n\n-- WARNING! --\n");
+			if (errors->duplicates)
+				emit(ctx, " * Duplicate item stacks detected!\n");
+			if (errors->key_quantity)
+				emit(ctx, " * Key item with 2+ quantity detected!\n");
+			if (errors->glitches)
+				emit(ctx, " * Invalid and/or glitch items detected!\n");
+		}
+}
+
+// Finds the cheapest way to enter each byte value after each previous
+// button. Every press adds its button's value to the byte (wrapping
+// around), and pressing the same button twice in a row enters the byte
+// instead, so no button can follow itself within a byte.
+void plan_joy_walks(struct Context *ctx, struct JoyWalks *walks)
+{
+	int queue[JOY_STATES + 1];
+	char queued[JOY_STATES];
+
+	for (int p = 0; p <= JOY_BUTTONS; p++)
+	{
+		int *dist = walks->dist[p];
+		unsigned short *prev = walks->prev[p];
+		int head = 0, tail = 0;
+
+		for (int state = 0; state < JOY_STATES; state++)
+			dist[state] = JOY_UNREACHABLE;
+		memset(queued, 0, sizeof(queued));
+
+		// Nothing pressed yet since the previous button, if there is one
+		if (p < JOY_BUTTONS)
+		{
+			dist[p] = 0;
+			prev[p] = JOY_START;
+			queue[tail++] = p;
+			queued[p] = 1;
+		}
+		else
+			for (int b = 0; b < JOY_BUTTONS; b++)
+			{
+				int state = joy_value(b) << 3 | b;
+				dist[state] = ctx->joy_costs[b];
+				prev[state] = JOY_START;
+				queue[tail++] = state;
+				queued[state] = 1;
+			}
+
+		// Relax until nothing gets any cheaper (costs are all positive)
+		while (head != tail)
+		{
+			int state = queue[head];
+			head = (head + 1) % (JOY_STATES + 1);
+			queued[state] = 0;
+
+			for (int b = 0; b < JOY_BUTTONS; b++)
+			{
+				if (b == (state & 7))
+					continue;
+
+				int next = (((state >> 3) + joy_value(b)) & 0xFF) << 3 | b;
+				if (dist[state] + ctx->joy_costs[b] < dist[next])
+				{
+					dist[next] = dist[state] + ctx->joy_costs[b];
+					prev[next] = state;
+					if (!queued[next])
+					{
+						queue[tail] = next;
+						tail = (tail + 1) % (JOY_STATES + 1);
+						queued[next] = 1;
+					}
+				}
+			}
+		}
+	}
+}
+
+
+// Value a button press adds to the byte being entered
+int joy_value(int button)
+{
+	return (button < 4 ? joy_vals[button] << 4 : joy_vals[button - 4]);
+}
+
+
+// Name of a button
+char* joy_name(int button)
+{
+	return (button < 4 ? joy_high[button] : joy_low[button - 4]);
+}
+
+
+// Converts hex string into joypad values for use with Full Control method
+// http://forums.glitchcity.info/index.php?topic=7744.0
+// The presses are planned over the whole input at once, for the fewest
+// presses (or the lowest total of ctx->joy_costs).
+void hex_to_joy(struct Context *ctx, unsigned char *bytes, int len)
+{
+	struct JoyWalks *walks = malloc(sizeof(struct JoyWalks));
+	plan_joy_walks(ctx, walks);
+
+	// Cheapest cost of entering every byte so far, for each button the last
+	// one can end on (or none before the first byte), and which button the
+	// byte before it ended on
+	int cost[JOY_BUTTONS + 1];
+	unsigned char *from = malloc(len * JOY_BUTTONS + 1);
+
+	for (int e = 0; e < JOY_BUTTONS; e++)
+		cost[e] = JOY_UNREACHABLE;
+	cost[JOY_BUTTONS] = 0;
+
+	for (int i = 0; i < len; i++)
+		joy_step(ctx, walks, cost, bytes[i], from + i * JOY_BUTTONS);
+
+	// Follow the cheapest plan back from its last button
+	unsigned char *ends = malloc(len + 1);
+	int end = joy_cheapest(cost);
+	for (int i = len - 1; i >= 0; i--)
+	{
+		ends[i] = end;
+		end = from[i * JOY_BUTTONS + end];
+	}
+
+	emit(ctx, "\nJoypad Values:\n\n");
+
+	// Print an initial A to skip the junk byte
+	emit(ctx, "A\n");
+
+	// Total number of button presses, just for funsies
+	// 3 = The initial A and the ending START + SELECT
+	int presses = 3;
+	int total = ctx->joy_costs[7] + ctx->joy_costs[4] + ctx->joy_costs[5];
+	int last = JOY_BUTTONS;
+
+	for (int i = 0; i < len; i++)
+	{
+		print_joy_byte(ctx, walks, last, bytes[i], ends[i], &presses, &total);
+		last = ends[i];
+	}
+
+	print_joy_total(ctx, presses, total);
+	flush_listing(ctx);
+
+	free(walks);
+	free(from);
+	free(ends);
+}
+
+
+// Extends the cheapest plans by a byte. cost goes from the bytes before it
+// to the bytes with it, for each button they can end on, and from gets the
+// button the byte before ended on for each button this one ends on.
+void joy_step(struct Context *ctx, struct JoyWalks *walks, int *cost, unsigned char byte, unsigned char *from)
+{
+	int next_cost[JOY_BUTTONS + 1];
+
+	for (int e = 0; e < JOY_BUTTONS; e++)
+	{
+		next_cost[e] = JOY_UNREACHABLE;
+		for (int p = 0; p <= JOY_BUTTONS; p++)
+		{
+			int walk = walks->dist[p][byte << 3 | e];
+			if (cost[p] == JOY_UNREACHABLE || walk == JOY_UNREACHABLE)
+				continue;
+
+			// The last button is pressed again to enter the byte
+			int total = cost[p] + walk + ctx->joy_costs[e];
+			if (total < next_cost[e])
+			{
+				next_cost[e] = total;
+				from[e] = p;
+			}
+		}
+	}
+	memcpy(cost, next_cost, JOY_BUTTONS * sizeof(*cost));
+	cost[JOY_BUTTONS] = JOY_UNREACHABLE;
+}
+
+
+// Returns the button the cheapest plan ends on
+int joy_cheapest(int *cost)
+{
+	int end = 0;
+	for (int e = 1; e < JOY_BUTTONS; e++)
+		if (cost[e] < cost[end])
+			end = e;
+	return end;
+}
+
+
+// Prints the buttons entering a byte, from the button the byte before ended
+// on (or none) to the one this one ends on, and counts them
+void print_joy_byte(struct Context *ctx, struct JoyWalks *walks, int last, unsigned char byte, int end, int *presses, int *total)
+{
+	int buttons[JOY_STATES];
+	int count = 0;
+
+	// Walk back from the byte's last press to the previous byte's
+	int state = byte << 3 | end;
+	for (; walks->prev[last][state] != JOY_START; state = walks->prev[last][state])
+		buttons[count++] = state & 7;
+	if (last == JOY_BUTTONS)
+		buttons[count++] = state & 7;
+
+	// Print out the button combination for this byte
+	for (int x = count - 1; x >= 0; x--)
+	{
+		emit(ctx, "%s ", joy_name(buttons[x]));
+		*total += ctx->joy_costs[buttons[x]];
+	}
+	emit(ctx, "%s\n", joy_name(end));
+	*total += ctx->joy_costs[end];
+	*presses += count + 1;
+}
+
+
+// Prints the EXIT code and number of button presses
+void print_joy_total(struct Context *ctx, int presses, int total)
+{
+	emit(ctx, "START + SELECT\n\n");
+	emit(ctx, "Total number of button presses: %d\n", presses);
+	if (total != presses)
+		emit(ctx, "Total cost: %d\n", total);
+}
+
+
+// Adds a byte to a streamed joypad plan, and prints the bytes whose buttons
+// are decided: every cheapest way to enter the bytes so far agrees on them.
+// If the window fills up first, its bytes are decided by the cheapest way
+// so far, which is the only time the stream can cost more than planning the
+// whole input at once.
+void joy_stream_byte(struct Context *ctx, struct JoyStream *stream, unsigned char byte)
+{
+	if (stream->count == JOY_WINDOW)
+	{
+		int end = joy_cheapest(stream->cost);
+		joy_stream_decide(ctx, stream, stream->count, end);
+		for (int e = 0; e < JOY_BUTTONS; e++)
+			if (e != end)
+				stream->cost[e] = JOY_UNREACHABLE;
+	}
+
+	int slot = (stream->first + stream->count++) % JOY_WINDOW;
+	stream->bytes[slot] = byte;
+	joy_step(ctx, stream->walks, stream->cost, byte, stream->from[slot]);
+
+	// Follow every way back until they all end on the same button
+	unsigned int ends = 0;
+	for (int e = 0; e < JOY_BUTTONS; e++)
+		if (stream->cost[e] != JOY_UNREACHABLE)
+			ends |= 1 << e;
+
+	for (int k = stream->count - 1; k >= 0 && ends; k--)
+	{
+		if (!(ends & (ends - 1)))
+		{
+			int end = 0;
+			for (; !(ends & 1 << end); end++);
+			joy_stream_decide(ctx, stream, k + 1, end);
+			return;
+		}
+
+		unsigned char *from = stream->from[(stream->first + k) % JOY_WINDOW];
+		unsigned int previous = 0;
+		for (int e = 0; e < JOY_BUTTONS; e++)
+			if (ends & 1 << e && from[e] < JOY_BUTTONS)
+				previous |= 1 << from[e];
+		ends = previous;
+	}
+}
+
+
+// Prints the first count bytes a streamed joypad plan holds back, the last
+// of them ending on the given button, and drops them
+void joy_stream_decide(struct Context *ctx, struct JoyStream *stream, int count, int end)
+{
+	unsigned char ends[JOY_WINDOW];
+
+	for (int k = count - 1; k >= 0; k--)
+	{
+		ends[k] = end;
+		end = stream->from[(stream->first + k) % JOY_WINDOW][end];
+	}
+
+	for (int k = 0; k < count; k++)
+	{
+		print_joy_byte(ctx, stream->walks, stream->last, stream->bytes[(stream->first + k) % JOY_WINDOW], ends[k], &stream->presses, &stream->total);
+		stream->last = ends[k];
+	}
+
+	stream->first = (stream->first + count) % JOY_WINDOW;
+	stream->count -= count;
+}
+
+
+// Converts machine code into an item list without any warnings, by searching
+// for an equivalent program whose item/quantity pairs are all obtainable.
+// The machine code itself is disassembled for the solved source.
+int solve_code(struct Context *ctx, unsigned char *bytes, int len, int gen)
+{
+	struct Solver *solver = calloc(1, sizeof(struct Solver));
+	int result = GB_OK;
+
+	for (int pos = 0; pos < len && !result;)
+	{
+		if (solver->node_count == MAX_SOLVE_NODES)
+			result = set_error(ctx, GB_ERROR_NO_SOLUTION, "Program is too big for %d item slots", ctx->slots);
+		else
+		{
+			struct SolveNode *node = &solver->nodes[solver->node_count++];
+			node->choices[0].size = instruction_size(bytes + pos, len - pos);
+			if (node->choices[0].size > len - pos)
+				node->choices[0].size = len - pos;
+			node->choice_count = 1;
+			node->target = -1;
+			memcpy(node->choices[0].bytes, bytes + pos, node->choices[0].size);
+			pos += node->choices[0].size;
+		}
+	}
+
+	if (!result)
+		result = solve(ctx, solver, gen);
+
+	free_solver(solver);
+	return result;
+}
+
+
+// Same as solve_code, but keeps the source's labels, comments and formatting
+// for every line the solver doesn't have to change
+int solve_source(struct Context *ctx, char *source, int gen)
+{
+	struct Solver *solver = calloc(1, sizeof(struct Solver));
+	struct Context scratch;
+	struct Buffer before = {0};
+	char *names[MAX_SOLVE_NODES] = {0};
+	int lines[MAX_SOLVE_NODES];
+	int result = GB_OK;
+
+	// Each line goes through the regular assembler to find out what it is
+	context_init(&scratch);
+
+	for (char *line = source; line && !result;)
+	{
+		char *newline = strchr(line, '\n');
+		int len = (newline ? newline - line : (int)strlen(line));
+		char *copy = malloc(len + 1);
+		memcpy(copy, line, len);
+		copy[len] = 0;
+
+		int size = scratch.machine_code.size;
+		int fixups = scratch.fixup_count;
+		int labels = scratch.label_count;
+
+		result = asm_to_hex(&scratch, copy);
+
+		// The assembler's error is the scratch context's, and scratch goes
+		// away once every line is read
+		if (result)
+			memcpy(ctx->error, scratch.error, sizeof(ctx->error));
+		// Instructions become nodes
+		else if (scratch.machine_code.size > size)
+		{
+			if (solver->node_count == MAX_SOLVE_NODES)
+			{
+				result = set_error(ctx, GB_ERROR_NO_SOLUTION, "Program is too big for %d item slots", ctx->slots);
+				free(copy);
+				break;
+			}
+
+			struct SolveNode *node = &solver->nodes[solver->node_count];
+			node->choices[0].size = scratch.machine_code.size - size;
+			node->choice_count = 1;
+			node->target = -1;
+			memcpy(node->choices[0].bytes, scratch.machine_code.data + size, node->choices[0].size);
+			node->source = malloc(len + 1);
+			memcpy(node->source, line, len);
+			node->source[len] = 0;
+
+			buffer_append(&before, (unsigned char*)"", 1);
+			node->before = (char*)before.data;
+			before = (struct Buffer){0};
+
+			// Label references are looked up once every label is known
+			if (scratch.fixup_count > fixups)
+			{
+				names[solver->node_count] = strdup(scratch.fixups[scratch.fixup_count - 1].name);
+				lines[solver->node_count] = scratch.fixups[scratch.fixup_count - 1].line;
+			}
+			solver->node_count++;
+		}
+		// Labels, comments and blank lines stay with the next instruction
+		else
+		{
+			if (scratch.label_count > labels)
+			{
+				if (solver->label_count == MAX_SOLVE_LABELS)
+				{
+					result = set_error(ctx, GB_ERROR_NO_SOLUTION, "Too many labels for the item solver");
+					free(copy);
+					break;
+				}
+				// The new label is the one defined on the line just assembled
+				struct SolveLabel *label = &solver->labels[solver->label_count++];
+				for (int l = 0; l < scratch.label_capacity; l++)
+					if (scratch.labels[l].name && scratch.labels[l].line == scratch.line_num - 1)
+						label->name = strdup(scratch.labels[l].name);
+				label->node = solver->node_count;
+			}
+			if (len)
+				buffer_append(&before, (unsigned char*)line, len);
+			buffer_append(&before, (unsigned char*)"\n", 1);
+		}
+
+		free(copy);
+		line = (newline ? newline + 1 : NULL);
+	}
+
+	buffer_append(&before, (unsigned char*)"", 1);
+	solver->after = (char*)before.data;
+
+	// Resolve the label references
+	for (int i = 0; i < solver->node_count && !result; i++)
+		if (names[i])
+		{
+			int l = 0;
+			for (; l < solver->label_count && strcmp(solver->labels[l].name, names[i]); l++);
+			if (l == solver->label_count)
+				result = set_error(ctx, GB_ERROR_UNDEFINED_LABEL, "Undefined label [%s] on line %d", names[i], lines[i]);
+			solver->nodes[i].target = l;
+		}
+
+	for (int i = 0; i < solver->node_count; i++)
+		free(names[i]);
+	context_free(&scratch);
+
+	if (!result)
+		result = solve(ctx, solver, gen);
+
+	free_solver(solver);
+	return result;
+}
+
+
+// Frees a solver and everything it holds
+void free_solver(struct Solver *solver)
+{
+	for (int i = 0; i < solver->node_count; i++)
+	{
+		free(solver->nodes[i].source);
+		free(solver->nodes[i].before);
+		for (int c = 0; c < solver->nodes[i].choice_count; c++)
+			free(solver->nodes[i].choices[c].text);
+	}
+	for (int i = 0; i < solver->label_count; i++)
+		free(solver->labels[i].name);
+	free(solver->after);
+	free(solver->memo);
+	free(solver);
+}
+
+
+// Finds the label at a node, making one up if there's none yet
+int label_at(struct Solver *solver, int node)
+{
+	for (int l = 0; l < solver->label_count; l++)
+		if (solver->labels[l].node == node)
+			return l;
+
+	if (solver->label_count == MAX_SOLVE_LABELS)
+		return -1;
+
+	unsigned int address = solver->offset;
+	for (int i = 0; i < node; i++)
+		address += solver->nodes[i].choices[0].size;
+
+	struct SolveLabel *label = &solver->labels[solver->label_count];
+	label->name = malloc(16);
+	sprintf(label->name, "l_%04x", address);
+	label->node = node;
+
+	// The new label goes right before the node
+	char **text = (node < solver->node_count ? &solver->nodes[node].before : &solver->after);
+	char *joined = malloc((*text ? strlen(*text) : 0) + 16);
+	sprintf(joined, "%s%s:\n", (*text ? *text : ""), label->name);
+	free(*text);
+	*text = joined;
+
+	return solver->label_count++;
+}
+
+
+// Turns numeric jumps into label references, so they keep pointing at the
+// same place as the solver moves things around, and adds every equivalent
+// encoding of each node
+int add_choices(struct Context *ctx, struct Solver *solver)
+{
+	unsigned int address = solver->offset;
+	unsigned int end = solver->offset;
+	for (int i = 0; i < solver->node_count; i++)
+		end += solver->nodes[i].choices[0].size;
+
+	for (int i = 0; i < solver->node_count; i++)
+	{
+		struct SolveNode *node = &solver->nodes[i];
+		unsigned char *bytes = node->choices[0].bytes;
+		unsigned char op = bytes[0];
+		char relative = (op == 0x18 || op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38);
+		char absolute = (op == 0xC2 || op == 0xC3 || op == 0xCA || op == 0xD2 || op == 0xDA ||
+			op == 0xC4 || op == 0xCC || op == 0xD4 || op == 0xDC || op == 0xCD);
+
+		if ((relative || absolute) && node->choices[0].size == (relative ? 2 : 3))
+		{
+			node->choices[0].ref = (relative ? 2 : 1);
+
+			if (node->target < 0)
+			{
+				unsigned int target = (relative ? address + 2 + (signed char)bytes[1] : (unsigned int)(bytes[1] | bytes[2] << 8));
+
+				// Jumps within the program follow the instruction they point to
+				if (target >= solver->offset && target <= end)
+				{
+					unsigned int at = solver->offset;
+					int j = 0;
+					for (; j < solver->node_count && at < target; at += solver->nodes[j++].choices[0].size);
+					if (at != target)
+						return set_error(ctx, GB_ERROR_NO_SOLUTION, "Jump into the middle of an instruction at %04X", address);
+					node->target = label_at(solver, j);
+				}
+				// Jumps outside of it are to a fixed address
+				else if (solver->label_count < MAX_SOLVE_LABELS)
+				{
+					solver->labels[solver->label_count].node = -1;
+					solver->labels[solver->label_count].address = target & 0xFFFF;
+					node->target = solver->label_count++;
+				}
+
+				if (node->target < 0)
+					return set_error(ctx, GB_ERROR_NO_SOLUTION, "Too many labels for the item solver");
+
+				// Its original text has the number in it
+				if (solver->labels[node->target].name)
+				{
+					free(node->source);
+					node->source = NULL;
+					node->choices[0].text = ref_text(op, solver->labels[node->target].name);
+				}
+			}
+		}
+
+		struct Choice *alt = &node->choices[1];
+
+		// An instruction cut short at the end of the code stays as it is
+		if (node->choices[0].size < instruction_size(bytes, MAX_INSTRUCTION_SIZE))
+			;
+		// jp <-> jr, with or without a condition
+		else if (op == 0xC3 || op == 0xC2 || op == 0xCA || op == 0xD2 || op == 0xDA ||
+			op == 0x18 || op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38)
+		{
+			unsigned char jp[] = {0xC3, 0xC2, 0xCA, 0xD2, 0xDA};
+			unsigned char jr[] = {0x18, 0x20, 0x28, 0x30, 0x38};
+			for (int x = 0; x < 5; x++)
+			{
+				if (op == jp[x])
+				{
+					alt->bytes[0] = jr[x];
+					alt->size = 2;
+					alt->ref = 2;
+				}
+				else if (op == jr[x])
+				{
+					alt->bytes[0] = jp[x];
+					alt->size = 3;
+					alt->ref = 1;
+				}
+			}
+			if (solver->labels[node->target].name)
+				alt->text = ref_text(alt->bytes[0], solver->labels[node->target].name);
+			node->choice_count = 2;
+		}
+		// call $00xx <-> rst xxh
+		else if (op == 0xCD && solver->labels[node->target].node < 0 && !(solver->labels[node->target].address & ~0x38))
+		{
+			alt->bytes[0] = 0xC7 | solver->labels[node->target].address;
+			alt->size = 1;
+			node->choice_count = 2;
+		}
+		else if ((op & 0xC7) == 0xC7)
+		{
+			memcpy(alt->bytes, (unsigned char[]){0xCD, op & 0x38, 0x00}, 3);
+			alt->size = 3;
+			node->choice_count = 2;
+		}
+		// ldh <-> ld to $FFxx
+		else if (op == 0xE0 || op == 0xF0)
+		{
+			memcpy(alt->bytes, (unsigned char[]){op | 0x0A, bytes[1], 0xFF}, 3);
+			alt->size = 3;
+			node->choice_count = 2;
+		}
+		else if ((op == 0xEA || op == 0xFA) && bytes[2] == 0xFF)
+		{
+			memcpy(alt->bytes, (unsigned char[]){op & ~0x0A, bytes[1]}, 2);
+			alt->size = 2;
+			node->choice_count = 2;
+		}
+		// ld (hl+),a <-> ld (hl),a / inc hl, and the same for the others
+		else if (op == 0x22 || op == 0x2A || op == 0x32 || op == 0x3A)
+		{
+			memcpy(alt->bytes, (unsigned char[]){(op & 0x08 ? 0x7E : 0x77), (op & 0x10 ? 0x2B : 0x23)}, 2);
+			alt->size = 2;
+			node->choice_count = 2;
+		}
+		else if ((op == 0x77 || op == 0x7E) && i + 1 < solver->node_count &&
+			(!solver->nodes[i + 1].before || !*solver->nodes[i + 1].before) &&
+			(solver->nodes[i + 1].choices[0].bytes[0] == 0x23 || solver->nodes[i + 1].choices[0].bytes[0] == 0x2B))
+		{
+			// Merge the two nodes
+			struct SolveNode *next = &solver->nodes[i + 1];
+			unsigned char step = next->choices[0].bytes[0];
+			char *source = NULL;
+
+			if (node->source && next->source)
+			{
+				source = malloc(strlen(node->source) + strlen(next->source) + 2);
+				sprintf(source, "%s\n%s", node->source, next->source);
+			}
+
+			bytes[1] = step;
+			node->choices[0].size = 2;
+			free(node->source);
+			node->source = source;
+			free(next->source);
+			free(next->before);
+			memmove(next, next + 1, (solver->node_count - i - 2) * sizeof(*next));
+			solver->node_count--;
+			for (int l = 0; l < solver->label_count; l++)
+				if (solver->labels[l].node > i)
+					solver->labels[l].node--;
+
+			alt->bytes[0] = (op == 0x77 ? 0x22 : 0x2A) | (step == 0x2B ? 0x10 : 0);
+			alt->size = 1;
+			node->choice_count = 2;
+		}
+
+		address += node->choices[0].size;
+	}
+
+	return GB_OK;
+}
+
+
+// Source text for a jump to a label
+char* ref_text(unsigned char op, char *name)
+{
+	char *text = malloc(strlen(name) + 16);
+	char *mnemonic = (op == 0xCD || (op & 0xC7) == 0xC4 ? "call" : (op & 0xC0 ? "jp" : "jr"));
+	char *conditions[] = {"nz,", "z,", "nc,", "c,"};
+	char *condition = "";
+
+	if (op != 0x18 && op != 0xC3 && op != 0xCD)
+		condition = conditions[(op >> 3) & 3];
+
+	sprintf(text, "%s %s%s", mnemonic, condition, name);
+	return text;
+}
+
+
+// Address a label ends up at, or -1 if the search hasn't placed it yet
+int label_address(struct Solver *solver, struct SolveState *state, int label)
+{
+	if (solver->labels[label].node < 0)
+		return solver->labels[label].address;
+	if (state->label_pos[label] < 0)
+		return -1;
+	return solver->offset + state->label_pos[label];
+}
+
+
+// Checks the item pair a byte belongs to, once both of its bytes are known
+int check_byte(struct Solver *solver, struct SolveState *state, int pos)
+{
+	int id = pos & ~1;
+
+	if (!state->known[id] || id + 1 >= state->pos || !state->known[id + 1])
+		return 1;
+
+	unsigned char item = state->bytes[id];
+	unsigned char quantity = state->bytes[id + 1];
+	unsigned char h = item >> 4;
+	unsigned char l = item & 0xF;
+
+	// The same warnings hex_to_gen gives
+	if ((solver->gen == 1 ? gen1_glitch_items[h][l] : gen2_glitch_items[h][l]))
+		return 0;
+	if ((solver->gen == 1 ? gen1_key_items[h][l] : gen2_key_items[h][l]) && quantity > 1)
+		return 0;
+	if (state->seen[item >> 6] >> (item & 63) & 1)
+		return 0;
+	state->seen[item >> 6] |= 1ULL << (item & 63);
+	return 1;
+}
+
+
+// Sets a byte that was waiting for a label
+int resolve_byte(struct Solver *solver, struct SolveState *state, int pos, unsigned char value)
+{
+	state->bytes[pos] = value;
+	state->known[pos] = 1;
+	return check_byte(solver, state, pos);
+}
+
+
+// Fills in the label reference of the instruction at from. Returns 0 if the
+// label is out of range or the bytes break an item pair.
+int resolve_ref(struct Solver *solver, struct SolveState *state, int from, int relative, int target)
+{
+	if (relative)
+	{
+		int distance = target - (int)(solver->offset + from + 2);
+		if (distance < -128 || distance > 127)
+			return 0;
+		return resolve_byte(solver, state, from + 1, distance & 0xFF);
+	}
+	return resolve_byte(solver, state, from + 1, target & 0xFF) &&
+		resolve_byte(solver, state, from + 2, target >> 8);
+}
+
+
+// Appends bytes to the program being searched. Returns 0 if they break an
+// item pair or a label reference.
+int append_choice(struct Solver *solver, struct SolveState *state, struct Choice *choice, int target)
+{
+	int from = state->pos;
+
+	if (from + choice->size > MAX_SOLVE_BYTES)
+		return 0;
+
+	for (int k = 0; k < choice->size; k++)
+	{
+		state->bytes[state->pos] = choice->bytes[k];
+		state->known[state->pos] = (!choice->ref || !k);
+		state->pos++;
+		if (state->known[state->pos - 1] && !check_byte(solver, state, state->pos - 1))
+			return 0;
+	}
+
+	if (choice->ref)
+	{
+		int address = label_address(solver, state, target);
+
+		// Forward references wait for their label
+		if (address < 0)
+		{
+			if (state->pending_count == MAX_SOLVE_PENDING)
+				return 0;
+
+			struct Pending *pending = &state->pending[state->pending_count++];
+			pending->from = from;
+			pending->label = target;
+			pending->relative = (choice->ref == 2);
+		}
+		else if (!resolve_ref(solver, state, from, choice->ref == 2, address))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+// Places the labels that come before a node, and resolves the references
+// that were waiting for them
+int place_labels(struct Solver *solver, struct SolveState *state, int node)
+{
+	for (int l = 0; l < solver->label_count; l++)
+	{
+		if (solver->labels[l].node != node)
+			continue;
+
+		state->label_pos[l] = state->pos;
+		for (int p = 0; p < state->pending_count; p++)
+			if (state->pending[p].label == l)
+			{
+				if (!resolve_ref(solver, state, state->pending[p].from, state->pending[p].relative, label_address(solver, state, l)))
+					return 0;
+				state->pending[p--] = state->pending[--state->pending_count];
+			}
+	}
+	return 1;
+}
+
+
+// Filler options before a node: nothing, one of the 1-byte instructions that
+// do nothing, two of them, or a jr to the next instruction
+int filler_bytes(int option, unsigned char *bytes)
+{
+	if (!option)
+		return 0;
+	if (option <= 8)
+	{
+		bytes[0] = solve_fillers[option - 1];
+		return 1;
+	}
+	if (option <= 72)
+	{
+		bytes[0] = solve_fillers[(option - 9) / 8];
+		bytes[1] = solve_fillers[(option - 9) % 8];
+		return 2;
+	}
+	bytes[0] = 0x18;
+	bytes[1] = 0x00;
+	return 2;
+}
+
+
+// Hashes everything about a partial program that matters to the rest of
+// the search: where it ends, the bytes still waiting to be paired, the
+// items so far and the labels placed so far. Partial programs that only
+// differ elsewhere solve (or fail) the same way.
+unsigned long long solve_hash(struct Solver *solver, struct SolveState *state, int node)
+{
+	unsigned long long hash = 0xCBF29CE484222325ULL;
+
+	#define SOLVE_HASH(value) hash = (hash ^ (unsigned long long)(value)) * 0x100000001B3ULL
+	SOLVE_HASH(node);
+	SOLVE_HASH(state->pos);
+	if (state->pos & 1)
+		SOLVE_HASH(state->known[state->pos - 1] << 8 | state->bytes[state->pos - 1]);
+	for (int p = 0; p < state->pending_count; p++)
+	{
+		int from = state->pending[p].from;
+		SOLVE_HASH(from << 16 | state->pending[p].label << 1 | state->pending[p].relative);
+		SOLVE_HASH(state->bytes[(from + 1) ^ 1] << 8 | state->bytes[(from + 2) ^ 1]);
+	}
+	for (int l = 0; l < solver->label_count; l++)
+		SOLVE_HASH(state->label_pos[l]);
+	for (int i = 0; i < 4; i++)
+		SOLVE_HASH(state->seen[i]);
+	#undef SOLVE_HASH
+
+	// Mix the high bits into the low ones, which pick the memo entry
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+
+// Depth-first search from a node, within the current budget of changes.
+// The task picks the (filler, choice) option of each node before the split,
+// and every option is tried after it. Returns 1 once a solution is found,
+// 0 if there's none, and -1 if there might be one with a bigger budget.
+int solve_node(struct Solver *solver, struct SolveState *state, int node, int task)
+{
+	// Give up on tasks that come after one that's already solved
+	if (__atomic_load_n(&solver->best_task, __ATOMIC_RELAXED) < task)
+		return 0;
+
+	if (!place_labels(solver, state, node))
+		return 0;
+
+	// Every node is placed
+	if (node == solver->node_count)
+	{
+		if (state->pending_count)
+			return 0;
+
+		// A lone item at the end can be any quantity
+		if (state->pos & 1)
+		{
+			unsigned char item = state->bytes[state->pos - 1];
+			unsigned char h = item >> 4;
+			unsigned char l = item & 0xF;
+			if ((solver->gen == 1 ? gen1_glitch_items[h][l] : gen2_glitch_items[h][l]) || state->seen[item >> 6] >> (item & 63) & 1)
+				return 0;
+		}
+
+		pthread_mutex_lock(&solver->lock);
+		if (task < solver->best_task)
+		{
+			solver->best_task = task;
+			solver->solution = *state;
+		}
+		pthread_mutex_unlock(&solver->lock);
+		return 1;
+	}
+
+	// The digit of the task for this node
+	int option = -1;
+	if (node < solver->split)
+	{
+		option = task;
+		for (int k = node + 1; k < solver->split; k++)
+			option /= FILLER_OPTIONS * 2;
+		option %= FILLER_OPTIONS * 2;
+	}
+
+	// Skip partial programs that are known to fail with this much budget
+	int remaining = solver->budget - state->cost;
+	unsigned long long key = solve_hash(solver, state, node);
+	unsigned long long *entry = &solver->memo[key & (SOLVE_MEMO_SIZE - 1)];
+	if (option < 0)
+	{
+		unsigned long long known = __atomic_load_n(entry, __ATOMIC_RELAXED);
+		if ((known & ~0xFFULL) == (key & ~0xFFULL) && (known & SOLVE_MEMO_USED))
+			if (!(known & SOLVE_MEMO_LIMITED) || (int)(known & 0xF) >= remaining)
+				return (known & SOLVE_MEMO_LIMITED ? -1 : 0);
+	}
+
+	struct SolveNode *current = &solver->nodes[node];
+	int result = 0;
+
+	for (int o = (option < 0 ? 0 : option); o < (option < 0 ? FILLER_OPTIONS * 2 : option + 1); o++)
+	{
+		int c = o % 2;
+		struct Choice filler = {.size = 0};
+		int cost = state->cost + (c > 0);
+
+		if (c >= current->choice_count)
+			continue;
+
+		filler.size = filler_bytes(o / 2, filler.bytes);
+		cost += filler.size;
+
+		// A quantity of 0 never warns, so fillers that put anything else
+		// into a quantity aren't worth trying (jr $00 has no choice)
+		int quantity = 1 - (state->pos & 1);
+		if (o / 2 < FILLER_OPTIONS - 1 && quantity < filler.size && filler.bytes[quantity])
+			continue;
+
+		if (cost > solver->budget)
+		{
+			result = -1;
+			continue;
+		}
+
+		struct SolveState next = *state;
+		next.cost = cost;
+		next.filler[node] = o / 2;
+		next.choice[node] = c;
+
+		if (!append_choice(solver, &next, &filler, -1) || !append_choice(solver, &next, &current->choices[c], current->target))
+			continue;
+
+		// Bail if even the smallest encoding of the rest can't fit
+		if (next.pos + solver->min_rest[node + 1] > solver->slots * 2)
+			continue;
+
+		int found = solve_node(solver, &next, node + 1, task);
+		if (found > 0)
+			return 1;
+		if (found < 0)
+			result = -1;
+	}
+
+	// Searches cut short by a solved task don't count as failures
+	if (option < 0 && __atomic_load_n(&solver->best_task, __ATOMIC_RELAXED) >= task)
+		__atomic_store_n(entry, (key & ~0xFFULL) | SOLVE_MEMO_USED | (result < 0 ? SOLVE_MEMO_LIMITED : 0) | remaining, __ATOMIC_RELAXED);
+	return result;
+}
+
+
+// Worker thread for the item solver. Each task is one combination of
+// options for the nodes before the split, and workers take them in order.
+void* solve_worker(void *arg)
+{
+	struct Solver *solver = arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&solver->lock);
+		int task = solver->next_task++;
+		int best = solver->best_task;
+		pthread_mutex_unlock(&solver->lock);
+
+		if (task >= solver->task_count || task > best)
+			break;
+
+		struct SolveState state = solver->start;
+		if (solve_node(solver, &state, 0, task) < 0)
+			__atomic_store_n(&solver->budget_hit, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+
+// Searches for the program with the fewest changes whose items are all
+// obtainable and fit in the slots, then prints it and its items
+int solve(struct Context *ctx, struct Solver *solver, int gen)
+{
+	int result;
+
+	solver->gen = gen;
+	solver->slots = ctx->slots;
+	solver->offset = ctx->offset;
+
+	if (solver->slots < 1 || solver->slots > MAX_SOLVE_SLOTS)
+		return set_error(ctx, GB_ERROR_NO_SOLUTION, "The item solver supports 1 to %d slots", MAX_SOLVE_SLOTS);
+
+	if ((result = add_choices(ctx, solver)))
+		return result;
+
+	// Smallest size of everything from each node on
+	solver->min_rest[solver->node_count] = 0;
+	for (int i = solver->node_count - 1; i >= 0; i--)
+	{
+		int size = solver->nodes[i].choices[0].size;
+		for (int c = 1; c < solver->nodes[i].choice_count; c++)
+			if (solver->nodes[i].choices[c].size < size)
+				size = solver->nodes[i].choices[c].size;
+		solver->min_rest[i] = solver->min_rest[i + 1] + size;
+	}
+
+	memset(&solver->start, 0, sizeof(solver->start));
+	for (int l = 0; l < MAX_SOLVE_LABELS; l++)
+		solver->start.label_pos[l] = -1;
+
+	pthread_mutex_init(&solver->lock, NULL);
+	solver->best_task = SOLVE_NONE;
+	solver->memo = calloc(SOLVE_MEMO_SIZE, sizeof(*solver->memo));
+
+	// Iterative deepening: allow one more change each round, so the first
+	// solution found changes as little as possible
+	int thread_count = (ctx->thread_count > 0 ? ctx->thread_count : 1);
+	pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+
+	// Threads split the search on the options of the first nodes. Tasks
+	// are in search order, so the lowest one that's solved is the same
+	// solution a single thread would find first.
+	solver->split = (thread_count > 1 ? (solver->node_count < 2 ? solver->node_count : 2) : 0);
+	solver->task_count = 1;
+	for (int i = 0; i < solver->split; i++)
+		solver->task_count *= FILLER_OPTIONS * 2;
+
+	for (solver->budget = 0; solver->budget <= MAX_SOLVE_COST && solver->best_task == SOLVE_NONE; solver->budget++)
+	{
+		solver->budget_hit = 0;
+		solver->next_task = 0;
+
+		for (int i = 0; i < thread_count; i++)
+			pthread_create(&threads[i], NULL, solve_worker, solver);
+		for (int i = 0; i < thread_count; i++)
+			pthread_join(threads[i], NULL);
+
+		// Nothing was left out because of the budget, so there's no solution
+		if (!solver->budget_hit)
+			break;
+	}
+
+	pthread_mutex_destroy(&solver->lock);
+	free(threads);
+
+	if (solver->best_task == SOLVE_NONE)
+		return set_error(ctx, GB_ERROR_NO_SOLUTION, "No equivalent program fits in %d item slots without warnings", solver->slots);
+
+	// Print the solved source
+	struct SolveState *solution = &solver->solution;
+	char *indent = "";
+	int indent_len = 0;
+	int pos = 0;
+
+	// New lines are indented like the source around them
+	for (int i = 0; i < solver->node_count && !indent_len; i++)
+		if (solver->nodes[i].source)
+		{
+			indent = solver->nodes[i].source;
+			indent_len = strspn(indent, " \t");
+		}
+
+	emit(ctx, "\nSolved source (%d change%s):\n\n", solution->cost, (solution->cost == 1 ? "" : "s"));
+	for (int i = 0; i < solver->node_count; i++)
+	{
+		struct SolveNode *node = &solver->nodes[i];
+		struct Choice *choice = &node->choices[solution->choice[i]];
+		unsigned char filler[2];
+		int filler_size = filler_bytes(solution->filler[i], filler);
+
+		if (node->source)
+		{
+			indent = node->source;
+			indent_len = strspn(indent, " \t");
+		}
+
+		// Source text goes out as is, since lines can be longer than emit()
+		// takes
+		if (node->before)
+			buffer_append(&ctx->listing, (unsigned char*)node->before, strlen(node->before));
+		pos += emit_instructions(ctx, solution->bytes + pos, filler_size, indent, indent_len);
+
+		if (!solution->choice[i] && node->source)
+		{
+			buffer_append(&ctx->listing, (unsigned char*)node->source, strlen(node->source));
+			buffer_append(&ctx->listing, (unsigned char*)"\n", 1);
+		}
+		else if (choice->text)
+		{
+			buffer_append(&ctx->listing, (unsigned char*)indent, indent_len);
+			emit(ctx, "%s\n", choice->text);
+		}
+		else
+			emit_instructions(ctx, solution->bytes + pos, choice->size, indent, indent_len);
+		pos += choice->size;
+	}
+	if (solver->after)
+		buffer_append(&ctx->listing, (unsigned char*)solver->after, strlen(solver->after));
+
+	hex_to_gen(ctx, solution->bytes, solution->pos, gen);
+	return GB_OK;
+}
+
+
+// Prints instructions as source lines, with the given indentation.
+// Returns their size.
+int emit_instructions(struct Context *ctx, unsigned char *bytes, int len, char *indent, int indent_len)
+{
+	char text[32];
+
+	for (int pos = 0; pos < len;)
+	{
+		pos += instruction_text(text, bytes + pos, len - pos);
+		buffer_append(&ctx->listing, (unsigned char*)indent, indent_len);
+		emit(ctx, "%s\n", text);
+	}
+
+	return len;
+}
+
+
+// Writes the instruction at the start of the given bytes as source text
+// ("ld a,$00"). Returns the number of bytes it takes up.
+int instruction_text(char *out, unsigned char *bytes, int len)
+{
+	struct Buffer line = {0};
+	int size = format_instruction(&line, bytes, len, 0, 0);
+	buffer_append(&line, (unsigned char*)"", 1);
+
+	// Skip the offset and the bytes to get to the instruction
+	char *c = (char*)line.data;
+	for (int token = 0; token <= size; token++)
+	{
+		for (; *c == ' '; c++);
+		for (; *c != ' '; c++);
+	}
+	for (; *c == ' '; c++);
+
+	// The mnemonic is padded to line up the parameters
+	char *mnemonic = c;
+	for (; *c && *c != ' ' && *c != '\n'; c++);
+	int mnemonic_len = c - mnemonic;
+	for (; *c == ' '; c++);
+	char *param = c;
+	for (; *c && *c != ' ' && *c != '\n'; c++);
+
+	sprintf(out, "%.*s%s%.*s", mnemonic_len, mnemonic, (c > param ? " " : ""), (int)(c - param), param);
+	free(line.data);
+	return size;
+}
+
+
+// Writes a byte to a machine's memory, keeping track of where
+void machine_write(struct Machine *m, unsigned short address, unsigned char value)
+{
+	m->memory[address] = value;
+	m->written[address >> 3] |= 1 << (address & 7);
+	m->writes++;
+}
+
+
+// Reads operand r of an instruction (B, C, D, E, H, L, (HL) or A)
+unsigned char machine_get(struct Machine *m, int r)
+{
+	return (r == 6 ? m->memory[m->regs[4] << 8 | m->regs[5]] : m->regs[r]);
+}
+
+
+// Writes operand r of an instruction
+void machine_set(struct Machine *m, int r, unsigned char value)
+{
+	if (r == 6)
+		machine_write(m, m->regs[4] << 8 | m->regs[5], value);
+	else
+		m->regs[r] = value;
+}
+
+
+// Reads register pair p (BC, DE, HL or SP)
+unsigned short machine_pair(struct Machine *m, int p)
+{
+	return (p == 3 ? m->sp : m->regs[p * 2] << 8 | m->regs[p * 2 + 1]);
+}
+
+
+// Writes register pair p
+void machine_set_pair(struct Machine *m, int p, unsigned short value)
+{
+	if (p == 3)
+		m->sp = value;
+	else
+	{
+		m->regs[p * 2] = value >> 8;
+		m->regs[p * 2 + 1] = value & 0xFF;
+	}
+}
+
+
+// Pushes a word onto the machine's stack
+void machine_push(struct Machine *m, unsigned short value)
+{
+	machine_write(m, --m->sp, value >> 8);
+	machine_write(m, --m->sp, value & 0xFF);
+}
+
+
+// Pops a word off the machine's stack
+unsigned short machine_pop(struct Machine *m)
+{
+	unsigned short value = m->memory[m->sp] | m->memory[(unsigned short)(m->sp + 1)] << 8;
+	m->sp += 2;
+	return value;
+}
+
+
+// Checks condition cc of a jump, call or return (NZ, Z, NC or C)
+int machine_condition(struct Machine *m, int cc)
+{
+	int flag = m->regs[6] & (cc & 2 ? FLAG_C : FLAG_Z);
+	return (cc & 1 ? flag != 0 : flag == 0);
+}
+
+
+// Applies ALU operation op (add, adc, sub, sbc, and, xor, or, cp) to A and
+// the given value
+void machine_alu(struct Machine *m, int op, unsigned char value)
+{
+	unsigned char a = m->regs[7];
+	int carry = ((op == 1 || op == 3) && (m->regs[6] & FLAG_C));
+	int result;
+	unsigned char flags;
+
+	if (op < 2)
+	{
+		result = a + value + carry;
+		flags = ((a & 0xF) + (value & 0xF) + carry > 0xF ? FLAG_H : 0) | (result > 0xFF ? FLAG_C : 0);
+	}
+	else if (op < 4 || op == 7)
+	{
+		result = a - value - carry;
+		flags = FLAG_N | ((a & 0xF) < (value & 0xF) + carry ? FLAG_H : 0) | (result < 0 ? FLAG_C : 0);
+	}
+	else if (op == 4)
+	{
+		result = a & value;
+		flags = FLAG_H;
+	}
+	else
+	{
+		result = (op == 5 ? a ^ value : a | value);
+		flags = 0;
+	}
+
+	m->regs[6] = flags | (result & 0xFF ? 0 : FLAG_Z);
+	if (op != 7)
+		m->regs[7] = result;
+}
+
+
+// Applies prefixed shift op (rlc, rrc, rl, rr, sla, sra, swap, srl) to the
+// given value and returns the result
+unsigned char machine_shift(struct Machine *m, int op, unsigned char value)
+{
+	int carry = ((m->regs[6] & FLAG_C) != 0);
+	int out = (op & 1 ? value & 1 : value >> 7);
+	int result;
+
+	switch (op)
+	{
+		case 0: result = value << 1 | out; break;
+		case 1: result = value >> 1 | out << 7; break;
+		case 2: result = value << 1 | carry; break;
+		case 3: result = value >> 1 | carry << 7; break;
+		case 4: result = value << 1; break;
+		case 5: result = value >> 1 | (value & 0x80); break;
+		case 6: result = value >> 4 | value << 4; out = 0; break;
+		default: result = value >> 1; break;
+	}
+
+	result &= 0xFF;
+	m->regs[6] = (result ? 0 : FLAG_Z) | (out ? FLAG_C : 0);
+	return result;
+}
+
+
+// Runs the machine from its PC until the code returns with the stack where
+// it started, halts, stops, locks up on an illegal opcode, or has run for
+// the given number of M-cycles. Instruction sizes and cycles come from the
+// same tables the disassembler uses.
+int machine_run(struct Machine *m, long limit)
+{
+	unsigned short start_sp = m->sp;
+	unsigned char *regs = m->regs;
+
+	while (m->cycles < limit)
+	{
+		unsigned short pc = m->pc;
+		unsigned char op = m->memory[pc];
+		unsigned char lo = m->memory[(unsigned short)(pc + 1)];
+		unsigned short nn = lo | m->memory[(unsigned short)(pc + 2)] << 8;
+		char branch = 0;
+		char returned = 0;
+
+		m->pc = pc + 1 + size_table[op >> 4][op & 0xF];
+		m->instructions++;
+
+		switch (op)
+		{
+			case 0x00:
+				break;
+
+			// 16-bit loads, increments and additions
+			case 0x01: case 0x11: case 0x21: case 0x31:
+				machine_set_pair(m, op >> 4, nn);
+				break;
+			case 0x03: case 0x13: case 0x23: case 0x33:
+				machine_set_pair(m, op >> 4, machine_pair(m, op >> 4) + 1);
+				break;
+			case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+				machine_set_pair(m, op >> 4, machine_pair(m, op >> 4) - 1);
+				break;
+			case 0x09: case 0x19: case 0x29: case 0x39:
+			{
+				unsigned short hl = machine_pair(m, 2);
+				unsigned short value = machine_pair(m, op >> 4);
+				regs[6] = (regs[6] & FLAG_Z) | ((hl & 0xFFF) + (value & 0xFFF) > 0xFFF ? FLAG_H : 0) |
+					(hl + value > 0xFFFF ? FLAG_C : 0);
+				machine_set_pair(m, 2, hl + value);
+				break;
+			}
+			case 0x08:
+				machine_write(m, nn, m->sp & 0xFF);
+				machine_write(m, (unsigned short)(nn + 1), m->sp >> 8);
+				break;
+
+			// Loads through BC, DE and HL
+			case 0x02: case 0x12:
+				machine_write(m, machine_pair(m, op >> 4), regs[7]);
+				break;
+			case 0x0A: case 0x1A:
+				regs[7] = m->memory[machine_pair(m, op >> 4)];
+				break;
+			case 0x22: case 0x32:
+				machine_write(m, machine_pair(m, 2), regs[7]);
+				machine_set_pair(m, 2, machine_pair(m, 2) + (op == 0x22 ? 1 : -1));
+				break;
+			case 0x2A: case 0x3A:
+				regs[7] = m->memory[machine_pair(m, 2)];
+				machine_set_pair(m, 2, machine_pair(m, 2) + (op == 0x2A ? 1 : -1));
+				break;
+
+			// 8-bit increments, decrements and loads
+			case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
+			{
+				unsigned char value = machine_get(m, op >> 3 & 7) + 1;
+				machine_set(m, op >> 3 & 7, value);
+				regs[6] = (regs[6] & FLAG_C) | (value ? 0 : FLAG_Z) | (value & 0xF ? 0 : FLAG_H);
+				break;
+			}
+			case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+			{
+				unsigned char value = machine_get(m, op >> 3 & 7) - 1;
+				machine_set(m, op >> 3 & 7, value);
+				regs[6] = (regs[6] & FLAG_C) | FLAG_N | (value ? 0 : FLAG_Z) | ((value & 0xF) == 0xF ? FLAG_H : 0);
+				break;
+			}
+			case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+				machine_set(m, op >> 3 & 7, lo);
+				break;
+
+			// Rotations of A, which always clear Z
+			case 0x07: case 0x0F: case 0x17: case 0x1F:
+				regs[7] = machine_shift(m, op >> 3, regs[7]);
+				regs[6] &= ~FLAG_Z;
+				break;
+
+			// Flag and accumulator tweaks
+			case 0x27:
+			{
+				int a = regs[7];
+				if (!(regs[6] & FLAG_N))
+				{
+					if ((regs[6] & FLAG_C) || a > 0x99)
+					{
+						a += 0x60;
+						regs[6] |= FLAG_C;
+					}
+					if ((regs[6] & FLAG_H) || (a & 0xF) > 0x9)
+						a += 0x06;
+				}
+				else
+				{
+					if (regs[6] & FLAG_C)
+						a -= 0x60;
+					if (regs[6] & FLAG_H)
+						a -= 0x06;
+				}
+				regs[7] = a;
+				regs[6] = (regs[6] & (FLAG_N | FLAG_C)) | (regs[7] ? 0 : FLAG_Z);
+				break;
+			}
+			case 0x2F:
+				regs[7] = ~regs[7];
+				regs[6] |= FLAG_N | FLAG_H;
+				break;
+			case 0x37:
+				regs[6] = (regs[6] & FLAG_Z) | FLAG_C;
+				break;
+			case 0x3F:
+				regs[6] = ((regs[6] & (FLAG_Z | FLAG_C)) ^ FLAG_C);
+				break;
+
+			// Relative and absolute jumps
+			case 0x18:
+				m->pc += (signed char)lo;
+				break;
+			case 0x20: case 0x28: case 0x30: case 0x38:
+				if ((branch = machine_condition(m, op >> 3 & 3)))
+					m->pc += (signed char)lo;
+				break;
+			case 0xC3:
+				m->pc = nn;
+				break;
+			case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+				if ((branch = machine_condition(m, op >> 3 & 3)))
+					m->pc = nn;
+				break;
+			case 0xE9:
+				m->pc = machine_pair(m, 2);
+				break;
+
+			// Calls and returns
+			case 0xCD:
+				machine_push(m, m->pc);
+				m->pc = nn;
+				break;
+			case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+				if ((branch = machine_condition(m, op >> 3 & 3)))
+				{
+					machine_push(m, m->pc);
+					m->pc = nn;
+				}
+				break;
+			case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+				machine_push(m, m->pc);
+				m->pc = op & 0x38;
+				break;
+			case 0xC9: case 0xD9:
+				m->ime |= (op == 0xD9);
+				returned = (m->sp == start_sp);
+				m->pc = machine_pop(m);
+				break;
+			case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+				if ((branch = machine_condition(m, op >> 3 & 3)))
+				{
+					returned = (m->sp == start_sp);
+					m->pc = machine_pop(m);
+				}
+				break;
+
+			// Stack
+			case 0xC1: case 0xD1: case 0xE1:
+				machine_set_pair(m, op >> 4 & 3, machine_pop(m));
+				break;
+			case 0xF1:
+			{
+				unsigned short value = machine_pop(m);
+				regs[7] = value >> 8;
+				regs[6] = value & 0xF0;
+				break;
+			}
+			case 0xC5: case 0xD5: case 0xE5:
+				machine_push(m, machine_pair(m, op >> 4 & 3));
+				break;
+			case 0xF5:
+				machine_push(m, regs[7] << 8 | regs[6]);
+				break;
+			case 0xE8: case 0xF8:
+			{
+				unsigned short value = m->sp + (signed char)lo;
+				regs[6] = ((m->sp & 0xF) + (lo & 0xF) > 0xF ? FLAG_H : 0) | ((m->sp & 0xFF) + lo > 0xFF ? FLAG_C : 0);
+				if (op == 0xE8)
+					m->sp = value;
+				else
+					machine_set_pair(m, 2, value);
+				break;
+			}
+			case 0xF9:
+				m->sp = machine_pair(m, 2);
+				break;
+
+			// High memory and absolute loads
+			case 0xE0:
+				machine_write(m, 0xFF00 | lo, regs[7]);
+				break;
+			case 0xF0:
+				regs[7] = m->memory[0xFF00 | lo];
+				break;
+			case 0xE2:
+				machine_write(m, 0xFF00 | regs[1], regs[7]);
+				break;
+			case 0xF2:
+				regs[7] = m->memory[0xFF00 | regs[1]];
+				break;
+			case 0xEA:
+				machine_write(m, nn, regs[7]);
+				break;
+			case 0xFA:
+				regs[7] = m->memory[nn];
+				break;
+
+			// Interrupts are only kept track of
+			case 0xF3: case 0xFB:
+				m->ime = (op == 0xFB);
+				break;
+
+			// ALU operations on immediate values
+			case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+				machine_alu(m, op >> 3 & 7, lo);
+				break;
+
+			// Prefixed instructions
+			case 0xCB:
+			{
+				int r = lo & 7;
+				int bit = lo >> 3 & 7;
+				unsigned char value = machine_get(m, r);
+
+				if (lo < 0x40)
+					machine_set(m, r, machine_shift(m, bit, value));
+				else if (lo < 0x80)
+					regs[6] = (regs[6] & FLAG_C) | FLAG_H | (value >> bit & 1 ? 0 : FLAG_Z);
+				else if (lo < 0xC0)
+					machine_set(m, r, value & ~(1 << bit));
+				else
+					machine_set(m, r, value | 1 << bit);
+
+				m->pc = pc + 2;
+				m->cycles += cb_cycle_table[lo >> 4][lo & 0xF];
+				continue;
+			}
+
+			// There's nothing to wake the CPU up again
+			case 0x76:
+				m->cycles += cycle_table[op >> 4][op & 0xF];
+				return RUN_HALTED;
+			case 0x10:
+				m->pc = pc + 2;
+				m->cycles += cycle_table[op >> 4][op & 0xF];
+				return RUN_STOPPED;
+
+			// Loads and ALU operations between registers
+			default:
+				if (op >= 0x40 && op < 0x80)
+					machine_set(m, op >> 3 & 7, machine_get(m, op & 7));
+				else if (op >= 0x80 && op < 0xC0)
+					machine_alu(m, op >> 3 & 7, machine_get(m, op & 7));
+				else
+				{
+					m->pc = pc;
+					m->instructions--;
+					return RUN_LOCKED;
+				}
+				break;
+		}
+
+		m->cycles += (branch ? branch_cycle_table : cycle_table)[op >> 4][op & 0xF];
+		if (returned)
+			return RUN_RETURNED;
+	}
+
+	return RUN_LIMIT;
+}
+
+
+// Runs machine code at the offset in the context's memory image and
+// registers, and prints how it went: how it ended, how long it took, the
+// registers it left, and every byte it wrote to. Returns GB_ERROR_NO_RETURN
+// if it didn't return.
+int run_code(struct Context *ctx, unsigned char *bytes, int len)
+{
+	struct Machine *m = calloc(1, sizeof(struct Machine));
+	int result = GB_OK;
+
+	if (ctx->memory)
+		memcpy(m->memory, ctx->memory, (ctx->memory_size < 0x10000 ? ctx->memory_size : 0x10000));
+	for (int i = 0; i < len; i++)
+		m->memory[(ctx->offset + i) & 0xFFFF] = bytes[i];
+
+	for (int p = 0; p < 3; p++)
+		machine_set_pair(m, p, ctx->registers[p + 1]);
+	m->regs[7] = ctx->registers[0] >> 8;
+	m->regs[6] = ctx->registers[0] & 0xF0;
+	m->sp = ctx->registers[4];
+	m->pc = ctx->offset;
+
+	int outcome = machine_run(m, ctx->run_limit);
+
+	emit(ctx, "\nRun:\n\n");
+	if (outcome == RUN_RETURNED)
+		emit(ctx, "Returned");
+	else if (outcome == RUN_HALTED)
+		emit(ctx, "Halted at %04X", m->pc);
+	else if (outcome == RUN_STOPPED)
+		emit(ctx, "Stopped at %04X", m->pc);
+	else if (outcome == RUN_LOCKED)
+		emit(ctx, "Locked up on opcode %02X at %04X", m->memory[m->pc], m->pc);
+	else
+		emit(ctx, "Still running at %04X", m->pc);
+	emit(ctx, " after %ld M-cycles (%ld T-cycles), %ld instruction%s\n\n", m->cycles, m->cycles * 4,
+		m->instructions, (m->instructions == 1 ? "" : "s"));
+
+	emit(ctx, "AF=%02X%02X  BC=%04X  DE=%04X  HL=%04X  SP=%04X  PC=%04X\n", m->regs[7], m->regs[6],
+		machine_pair(m, 0), machine_pair(m, 1), machine_pair(m, 2), m->sp, m->pc);
+
+	// Every byte written to, with what was left there, in rows of up to 16
+	int addresses = 0;
+	for (int i = 0; i < 0x10000 / 8; i++)
+		for (int bits = m->written[i]; bits; bits &= bits - 1)
+			addresses++;
+	emit(ctx, "\nMemory writes: %ld (%d address%s)\n", m->writes, addresses, (addresses == 1 ? "" : "es"));
+
+	for (int address = 0; address < 0x10000;)
+	{
+		if (!(m->written[address >> 3] & (1 << (address & 7))))
+		{
+			address++;
+			continue;
+		}
+
+		emit(ctx, "\n%04X ", address);
+		int row = 0;
+		for (; row < 16 && address < 0x10000 && (m->written[address >> 3] & (1 << (address & 7))); row++)
+			emit(ctx, " %02X", m->memory[address++]);
+		if (ctx->listing.size >= LISTING_BLOCK_SIZE)
+			flush_listing(ctx);
+	}
+	emit(ctx, "\n");
+	flush_listing(ctx);
+
+	if (outcome != RUN_RETURNED)
+	{
+		static const char *reasons[] = {"", "halted", "stopped", "locked up", "ran out of cycles"};
+		result = set_error(ctx, GB_ERROR_NO_RETURN, "Code didn't return (%s at %04X)", reasons[outcome], m->pc);
+	}
+
+	free(m);
+	return result;
+}
+
+
+
+// Sets up an empty watch
+void watch_init(struct Watch *watch)
+{
+	memset(watch, 0, sizeof(*watch));
+}
+
+
+// Frees everything a watch holds
+void watch_free(struct Watch *watch)
+{
+	for (int i = 0; i < watch->line_count; i++)
+	{
+		free(watch->lines[i].label);
+		free(watch->lines[i].target);
+	}
+	free(watch->lines);
+	free(watch->source.data);
+	memset(watch, 0, sizeof(*watch));
+}
+
+
+// Assembles one line of a watched file on its own, keeping what it defines
+// and references to be looked up later
+void watch_assemble(struct Watch *watch, int i, char *text, int start, int len)
+{
+	struct WatchLine *line = &watch->lines[i];
+	struct Context scratch;
+
+	memset(line, 0, sizeof(*line));
+	line->start = start;
+	line->length = len;
+
+	// The assembler reads up to a terminator, so it gets a copy
+	char *copy = malloc(len + 1);
+	memcpy(copy, text + start, len);
+	copy[len] = 0;
+
+	context_init(&scratch);
+	scratch.line_num = i + 1;
+	if (asm_to_hex(&scratch, copy) || scratch.machine_code.size > (int)sizeof(line->bytes))
+		line->failed = WATCH_PARSE;
+	else
+	{
+		line->size = scratch.machine_code.size;
+		if (line->size)
+			memcpy(line->bytes, scratch.machine_code.data, line->size);
+
+		for (int l = 0; l < scratch.label_capacity; l++)
+			if (scratch.labels[l].name)
+				line->label = strdup(scratch.labels[l].name);
+
+		if (scratch.fixup_count)
+		{
+			line->target = strdup(scratch.fixups[0].name);
+			line->reference = scratch.fixups[0].position;
+			line->relative = scratch.fixups[0].relative;
+		}
+	}
+
+	context_free(&scratch);
+	free(copy);
+	watch->failures += (line->failed != WATCH_OK);
+	watch->assembled++;
+}
+
+
+// Patches the label reference of a watched line into its bytes and the
+// machine code
+void watch_resolve(struct Context *ctx, struct Watch *watch, int i)
+{
+	struct WatchLine *line = &watch->lines[i];
+	struct Label *target = find_label(ctx, line->target);
+	char failed = WATCH_OK;
+
+	if (!target)
+		failed = WATCH_UNDEFINED;
+	else if (line->relative)
+	{
+		int distance = (int)target->address - (ctx->offset + line->address + line->size);
+		if (distance < -128 || distance > 127)
+			failed = WATCH_RANGE;
+		line->bytes[line->reference] = distance & 0xFF;
+	}
+	else
+	{
+		line->bytes[line->reference] = target->address & 0xFF;
+		line->bytes[line->reference + 1] = (target->address >> 8) & 0xFF;
+	}
+
+	if (target)
+		memcpy(ctx->machine_code.data + line->address, line->bytes, line->size);
+	watch->failures += (failed != WATCH_OK) - (line->failed != WATCH_OK);
+	line->failed = failed;
+	watch->resolved++;
+}
+
+
+// Returns the first line of a watched file that starts at or after the
+// given position of its source (or the line count if none do)
+int watch_line_at(struct Watch *watch, int pos)
+{
+	int low = 0;
+	int high = watch->line_count;
+
+	while (low < high)
+	{
+		int middle = (low + high) / 2;
+		if (watch->lines[middle].start < pos)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+
+// Sets the error for the first line of a watched file that's wrong, with the
+// line numbers it has now
+int watch_error(struct Context *ctx, struct Watch *watch)
+{
+	for (int i = 0; watch->failures && i < watch->line_count; i++)
+	{
+		struct WatchLine *line = &watch->lines[i];
+
+		if (line->failed == WATCH_PARSE)
+		{
+			struct Context scratch;
+			char *copy = malloc(line->length + 1);
+			memcpy(copy, watch->source.data + line->start, line->length);
+			copy[line->length] = 0;
+
+			context_init(&scratch);
+			scratch.line_num = i + 1;
+			if (asm_to_hex(&scratch, copy))
+				set_error(ctx, GB_ERROR_PARSE, "%s", scratch.error);
+			else
+				set_error(ctx, GB_ERROR_PARSE, "Couldn't parse line %d", i + 1);
+			context_free(&scratch);
+			free(copy);
+			return GB_ERROR_PARSE;
+		}
+		if (line->failed == WATCH_DUPLICATE)
+			return set_error(ctx, GB_ERROR_DUPLICATE_LABEL, "Label [%s] on line %d was already defined on line %d",
+				line->label, i + 1, find_label(ctx, line->label)->line);
+		if (line->failed == WATCH_UNDEFINED)
+			return set_error(ctx, GB_ERROR_UNDEFINED_LABEL, "Undefined label [%s] on line %d", line->target, i + 1);
+		if (line->failed == WATCH_RANGE)
+			return set_error(ctx, GB_ERROR_JUMP_RANGE, "Label [%s] is out of range for jr on line %d (%d bytes away)", line->target, i + 1,
+				(int)find_label(ctx, line->target)->address - (ctx->offset + line->address + line->size));
+	}
+
+	ctx->error[0] = 0;
+	return GB_OK;
+}
+
+
+// Brings a watched file up to date with its new source. Only the lines that
+// changed are assembled again; the ones after them are moved along with
+// their labels, and only the references that could have changed are patched
+// again. The machine code is left in the context.
+int watch_update(struct Context *ctx, struct Watch *watch, char *source, int len)
+{
+	char *old = (char*)watch->source.data;
+	int old_len = watch->source.size;
+	int old_count = watch->line_count;
+	int limit = (len < old_len ? len : old_len);
+
+	watch->removed = 0;
+	watch->assembled = 0;
+	watch->resolved = 0;
+
+	// Whole lines (newline included) that are the same at the start
+	int same = 0;
+	for (; same + 4096 <= limit && !memcmp(old + same, source + same, 4096); same += 4096);
+	for (; same < limit && old[same] == source[same]; same++);
+	if (same == len && len == old_len)
+		return watch_error(ctx, watch);
+
+	int prefix = 0;
+	for (int low = 0, high = old_count; low < high;)
+	{
+		int middle = (low + high) / 2;
+		if (watch->lines[middle].start + watch->lines[middle].length + 1 <= same)
+			prefix = low = middle + 1;
+		else
+			high = middle;
+	}
+	int begin = (prefix ? watch->lines[prefix - 1].start + watch->lines[prefix - 1].length + 1 : 0);
+
+	// And at the end, as long as the newline before them is the same too
+	int tail = 0;
+	limit -= begin;
+	for (; tail + 4096 <= limit && !memcmp(old + old_len - tail - 4096, source + len - tail - 4096, 4096); tail += 4096);
+	for (; tail < limit && old[old_len - tail - 1] == source[len - tail - 1]; tail++);
+
+	int kept = watch_line_at(watch, old_len - tail + 1);
+	if (kept < prefix)
+		kept = prefix;
+	int suffix = old_count - kept;
+	int end = (suffix ? watch->lines[kept].start + len - old_len : len);
+
+	// Count the lines that replace the ones in between
+	int added = 0;
+	for (int pos = begin; pos < end; added++)
+	{
+		char *newline = memchr(source + pos, '\n', end - pos);
+		pos = (newline ? newline - source + 1 : end);
+	}
+	int removed = old_count - prefix - suffix;
+	int moved = prefix + added;
+	int start = (prefix ? watch->lines[prefix - 1].address + watch->lines[prefix - 1].size : 0);
+	int old_size = 0;
+	int new_size = 0;
+	char labels_changed = 0;
+
+	watch->first_changed = prefix;
+	watch->removed = removed;
+
+	// Drop the lines that changed and make room for their replacements
+	for (int i = prefix; i < prefix + removed; i++)
+	{
+		struct WatchLine *line = &watch->lines[i];
+		labels_changed |= (line->label != NULL);
+		old_size += line->size;
+		watch->failures -= (line->failed != WATCH_OK);
+		free(line->label);
+		free(line->target);
+	}
+	if (old_count - removed + added > watch->line_capacity)
+	{
+		watch->line_capacity = (old_count - removed + added > watch->line_capacity * 2 ? old_count - removed + added : watch->line_capacity * 2);
+		watch->lines = realloc(watch->lines, watch->line_capacity * sizeof(struct WatchLine));
+	}
+	memmove(watch->lines + moved, watch->lines + prefix + removed, suffix * sizeof(struct WatchLine));
+	watch->line_count = old_count - removed + added;
+
+	for (int i = prefix, pos = begin; i < moved; i++)
+	{
+		char *newline = memchr(source + pos, '\n', end - pos);
+		int length = (newline ? newline - source : end) - pos;
+		watch_assemble(watch, i, source, pos, length);
+		watch->lines[i].address = start + new_size;
+		labels_changed |= (watch->lines[i].label != NULL);
+		new_size += watch->lines[i].size;
+		pos += length + 1;
+	}
+
+	// Everything after the changed lines moves by the same amount
+	int shift = new_size - old_size;
+	if (shift || len != old_len)
+		for (int i = moved; i < watch->line_count; i++)
+		{
+			watch->lines[i].start += len - old_len;
+			watch->lines[i].address += shift;
+		}
+
+	watch->source.size = 0;
+	buffer_append(&watch->source, (unsigned char*)source, len);
+
+	struct Buffer *code = &ctx->machine_code;
+	int rest = code->size - (start + old_size);
+	if (shift > 0)
+		buffer_reserve(code, shift);
+	if (rest)
+		memmove(code->data + start + new_size, code->data + start + old_size, rest);
+	code->size += shift;
+	for (int i = prefix; i < moved; i++)
+		if (watch->lines[i].size)
+			memcpy(code->data + watch->lines[i].address, watch->lines[i].bytes, watch->lines[i].size);
+
+	// Labels are defined again if any came or went, and moved otherwise
+	if (labels_changed)
+	{
+		arena_reset(&ctx->names);
+		free(ctx->labels);
+		ctx->labels = NULL;
+		ctx->label_count = 0;
+		ctx->label_capacity = 0;
+
+		for (int i = 0; i < watch->line_count; i++)
+		{
+			struct WatchLine *line = &watch->lines[i];
+			if (!line->label)
+				continue;
+			ctx->line_num = i + 1;
+			char failed = (add_label(ctx, line->label, ctx->offset + line->address) ? WATCH_DUPLICATE : WATCH_OK);
+			watch->failures += (failed != WATCH_OK) - (line->failed != WATCH_OK);
+			line->failed = failed;
+		}
+	}
+	else if (shift || added != removed)
+		for (int l = 0; l < ctx->label_capacity; l++)
+			if (ctx->labels[l].name && ctx->labels[l].line > prefix + removed)
+			{
+				ctx->labels[l].line += added - removed;
+				ctx->labels[l].address += shift;
+			}
+
+	// Patch the references that were assembled again, and the ones whose
+	// distance to their label may have changed: absolute ones to labels that
+	// moved, and relative ones across the changed lines
+	int first = (labels_changed || shift ? 0 : prefix);
+	int last = (labels_changed || shift ? watch->line_count : moved);
+	for (int i = first; i < last; i++)
+	{
+		struct WatchLine *line = &watch->lines[i];
+		if (!line->target)
+			continue;
+
+		if (!labels_changed && (i < prefix || i >= moved))
+		{
+			struct Label *target = find_label(ctx, line->target);
+			char target_moved = (target && target->line > moved);
+			if (!target || (line->relative ? target_moved == (i >= moved) : !target_moved))
+				continue;
+		}
+		watch_resolve(ctx, watch, i);
+	}
+
+	return watch_error(ctx, watch);
+}
@@ -0,0 +1,261 @@
+#ifndef LIBGBZ80AID_H
+#define LIBGBZ80AID_H
+
+#include <stdio.h>
+
+
+// Result codes returned by the conversion functions
+enum {
+	GB_OK = 0,
+	GB_ERROR_PARSE,
+	GB_ERROR_UNDEFINED_LABEL,
+	GB_ERROR_DUPLICATE_LABEL,
+	GB_ERROR_JUMP_RANGE,
+	GB_ERROR_FILE,
+	GB_ERROR_NO_SOLUTION,
+	GB_ERROR_NO_RETURN
+};
+
+// Ways a machine can stop running code
+enum {
+	RUN_RETURNED = 0,
+	RUN_HALTED,
+	RUN_STOPPED,
+	RUN_LOCKED,
+	RUN_LIMIT
+};
+
+// Struct for holding raw machine code
+struct Buffer {
+	unsigned char *data;
+	int size;
+	int capacity;
+};
+
+// Struct for holding one block of an arena, and the one allocated before it
+struct ArenaBlock {
+	struct ArenaBlock *next;
+	int size;
+	char data[];
+};
+
+// Struct for holding allocations that are all released at once, bumped out
+// of big blocks instead of allocated one by one
+struct Arena {
+	struct ArenaBlock *block;
+	int used;
+};
+
+// Struct for holding label information
+struct Label {
+	unsigned int address;
+	char *name;
+	int line;
+};
+
+// Struct for holding label references that are patched after assembly
+struct Fixup {
+	char *name;
+	int position;
+	unsigned int address;
+	int line;
+	char relative;
+
+	// Written as "jp!" or "jr!", which -relax leaves alone
+	char fixed;
+};
+
+// Struct for holding a machine running code, with no display or interrupts.
+// The registers are in operand order with F where (hl) would be: B, C, D, E,
+// H, L, F, A.
+struct Machine {
+	unsigned char memory[0x10000];
+	unsigned char written[0x10000 / 8];
+	unsigned char regs[8];
+	unsigned short sp;
+	unsigned short pc;
+	char ime;
+	long cycles;
+	long instructions;
+	long writes;
+};
+
+// Struct for holding one line of a watched source file, assembled on its own
+struct WatchLine {
+	// Where its text is in the source
+	int start;
+	int length;
+
+	// Its machine code (at most the longest instruction) and where that goes
+	unsigned char bytes[3];
+	int size;
+	int address;
+
+	// Label it defines, or label it references and where in its bytes
+	char *label;
+	char *target;
+	int reference;
+	char relative;
+
+	// What's wrong with it (WATCH_OK when nothing is)
+	char failed;
+};
+
+// Struct for holding a source file kept assembled between edits (-watch).
+// Its machine code and labels are the context's.
+struct Watch {
+	struct Buffer source;
+	struct WatchLine *lines;
+	int line_count;
+	int line_capacity;
+	int failures;
+
+	// What the last update did: the first line that changed, how many lines
+	// were dropped and assembled again, and how many references were
+	// patched again
+	int first_changed;
+	int removed;
+	int assembled;
+	int resolved;
+};
+
+// Ways a watched line can be wrong
+enum {
+	WATCH_OK = 0,
+	WATCH_PARSE,
+	WATCH_DUPLICATE,
+	WATCH_UNDEFINED,
+	WATCH_RANGE
+};
+
+// Struct for holding everything one conversion needs. Contexts don't share
+// any mutable state, so separate contexts can be used on separate threads.
+struct Context {
+	// Offset to begin calculating at (-ofs)
+	int offset;
+
+	// Show item warnings (-w turns them off)
+	char show_warnings;
+
+	// Disassembly worker threads, and the size of the chunks they work on
+	int thread_count;
+	int chunk_size;
+
+	// Follow control flow from entry points instead of sweeping linearly
+	char trace;
+	int entry_count;
+	unsigned int entry_points[64];
+
+	// Show how many cycles each instruction and path takes (-c)
+	char cycles;
+
+	// Shrink assembled code before patching label references (-O)
+	char optimize;
+
+	// Pick jr or jp for each label jump, whichever is shorter (-relax)
+	char relax;
+
+	// Rewrite item output until it has no warnings (-solve), within this
+	// many bag slots (-slots)
+	char solve;
+	int slots;
+
+	// Run the code instead of converting it (-run), at the -ofs offset, in
+	// this memory image (-mem, which the context doesn't own), with AF, BC,
+	// DE, HL and SP set to these (-regs), for at most this many M-cycles
+	// (-limit)
+	char run;
+	unsigned char *memory;
+	int memory_size;
+	unsigned short registers[5];
+	long run_limit;
+
+	// Cost of pressing each joypad button (DOWN, UP, LEFT, RIGHT, START,
+	// SELECT, B, A), which joy output keeps as low as it can (-joycost)
+	int joy_costs[8];
+
+	// Directory that keeps rendered output between runs (-cache), and how
+	// many bytes it may hold (-cachesize). Only the command line uses these.
+	char *cache_dir;
+	long cache_size;
+
+	// Output sink, called with each block of rendered output
+	void (*write)(void *user, const char *data, int len);
+	void *user;
+
+	// Description of the last error
+	char error[256];
+
+	// Offset of the current byte, and the current source line
+	int cur_offset;
+	int line_num;
+
+	// Assembled (or parsed) machine code
+	struct Buffer machine_code;
+
+	// Label and reference names, which live as long as the context, and the
+	// temporaries of the line being assembled, which only live until the next
+	struct Arena names;
+	struct Arena scratch;
+
+	// Labels (open-addressed hash table) and references to patch
+	struct Label *labels;
+	int label_count;
+	int label_capacity;
+	struct Fixup *fixups;
+	int fixup_count;
+	int fixup_capacity;
+
+	// Output waiting to be written to the sink
+	struct Buffer listing;
+};
+
+
+// Contexts
+void context_init(struct Context*);
+void context_free(struct Context*);
+void file_sink(void*, const char*, int);
+void buffer_sink(void*, const char*, int);
+void init_tables(void);
+
+// Input
+void buffer_append(struct Buffer*, unsigned char*, int);
+int parse_hex(struct Context*, char*, struct Buffer*);
+void read_binary(FILE*, struct Buffer*);
+
+// Decoding
+int instruction_size(unsigned char*, int);
+int hex_decode(unsigned char*, const char*, int);
+void hex_encode(char*, const unsigned char*, int);
+
+// Assembly
+int asm_to_hex(struct Context*, char*);
+int assemble_file(struct Context*, char*);
+int assemble_stream(struct Context*, FILE*);
+int assemble_source(struct Context*, char*);
+int resolve_labels(struct Context*);
+
+// Output
+void print_hex(struct Context*, unsigned char*, int);
+void hex_to_asm(struct Context*, unsigned char*, int, int);
+void stream_to_asm(struct Context*, FILE*, int);
+int stream_hex(struct Context*, FILE*, char*);
+int stream_asm(struct Context*, FILE*);
+void parallel_to_asm(struct Context*, unsigned char*, int, int);
+void trace_to_asm(struct Context*, unsigned char*, int, int);
+void timing_to_asm(struct Context*, unsigned char*, int, int);
+void hex_to_gen(struct Context*, unsigned char*, int, int);
+void hex_to_joy(struct Context*, unsigned char*, int);
+int solve_code(struct Context*, unsigned char*, int, int);
+int solve_source(struct Context*, char*, int);
+
+// Running
+int machine_run(struct Machine*, long);
+int run_code(struct Context*, unsigned char*, int);
+
+// Watching
+void watch_init(struct Watch*);
+void watch_free(struct Watch*);
+int watch_update(struct Context*, struct Watch*, char*, int);
+
+#endif